@@ -1,15 +1,25 @@
 #include <QtCore/qloggingcategory.h>
+#include <QtCore/qfileinfo.h>
+#include <QtCore/qdatetime.h>
 #include <QtGui/qpainter.h>
+#include <QtGui/qguiapplication.h>
+#include <QtGui/qscreen.h>
+#include <atomic>
+#include <algorithm>
 #include "animation_viewer_p.h"
 
 Q_LOGGING_CATEGORY(logger, "lafplay.ffmpeg")
 
+static QAtomicInt defaultThreadCount(0);
+static QAtomicInt livingViewers(0);  // 只有一个的时候，默认用所有的核解码。
+
 AVContext::AVContext()
     : formatCtx(nullptr)
     , codecCtx(nullptr)
     , swsContext(nullptr)
     , nativeFrame(nullptr)
-    , rgbFrame(nullptr)
+    , scaledFrame(nullptr)
+    , scaleThreads(1)
     , videoStream(0)
     , timeBase(0.001)
 {
@@ -17,15 +27,12 @@ AVContext::AVContext()
 
 AVContext::~AVContext()
 {
-    if (rgbFrame) {
-        if (rgbFrame->data[0]) {
-            av_freep(&rgbFrame->data[0]);
-        }
-        av_frame_free(&rgbFrame);
-    }
     if (nativeFrame) {
         av_frame_free(&nativeFrame);
     }
+    if (scaledFrame) {
+        av_frame_free(&scaledFrame);
+    }
     if (swsContext) {
         sws_freeContext(swsContext);
     }
@@ -61,8 +68,28 @@ bool AVContext::initSwsContext()
         orignalFormat = codecCtx->pix_fmt;
         break;
     }
-    swsContext = sws_getContext(codecCtx->width, codecCtx->height, orignalFormat, codecCtx->width, codecCtx->height,
-                                AV_PIX_FMT_RGBA, SWS_BILINEAR, nullptr, nullptr, nullptr);
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+    // 和 sws_getContext() 做的一样，只是多了 threads。
+    swsContext = sws_alloc_context();
+    if (swsContext) {
+        av_opt_set_int(swsContext, "srcw", codecCtx->width, 0);
+        av_opt_set_int(swsContext, "srch", codecCtx->height, 0);
+        av_opt_set_int(swsContext, "src_format", orignalFormat, 0);
+        av_opt_set_int(swsContext, "dstw", width, 0);
+        av_opt_set_int(swsContext, "dsth", height, 0);
+        av_opt_set_int(swsContext, "dst_format", AV_PIX_FMT_RGBA, 0);
+        av_opt_set_int(swsContext, "sws_flags", SWS_BILINEAR, 0);
+        // 老一点的 swscale 没有这个选项，那就还是一个线程。scaleThreads 为 0 时由 swscale 自己按核数决定。
+        av_opt_set_int(swsContext, "threads", scaleThreads, 0);
+        if (sws_init_context(swsContext, nullptr, nullptr) < 0) {
+            sws_freeContext(swsContext);
+            swsContext = nullptr;
+        }
+    }
+#else
+    swsContext = sws_getContext(codecCtx->width, codecCtx->height, orignalFormat, width, height, AV_PIX_FMT_RGBA,
+                                SWS_BILINEAR, nullptr, nullptr, nullptr);
+#endif
     if (!swsContext) {
         qCWarning(logger) << "can not allocate sws context.";
         return false;
@@ -70,7 +97,151 @@ bool AVContext::initSwsContext()
     return true;
 }
 
-AVContext *makeContext(const QString &url, QString *reason)
+static void keepImageBuffer(void *, uint8_t *)
+{
+    // the QImage owns it.
+}
+
+FrameBufferPool::FrameBufferPool()
+    : next(0)
+    , width(0)
+    , height(0)
+{
+}
+
+FrameBufferPool::~FrameBufferPool()
+{
+    clear();
+}
+
+QImage *FrameBufferPool::acquire(int width, int height, AVBufferRef **buffer)
+{
+    if (width != this->width || height != this->height) {
+        clear();
+        this->width = width;
+        this->height = height;
+    }
+    const int n = images.size();
+    for (int i = 0; i < n; ++i) {
+        QImage &image = images[(next + i) % n];
+        if (image.isDetached()) {
+            // the gui thread dropped its last copy with an ordered deref. pair it, so its reads of the old pixels
+            // happen before our writes.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (buffer) {
+                *buffer = buffers.at((next + i) % n);
+            }
+            next = (next + i + 1) % n;
+            return &image;
+        }
+    }
+    // every slot is in flight, add one. sws_scale() is faster with aligned rows.
+    const int bytesPerLine = FFALIGN(width * 4, 32);
+    uchar *data = static_cast<uchar *>(av_malloc(static_cast<size_t>(bytesPerLine) * static_cast<size_t>(height)));
+    if (!data) {
+        qCWarning(logger) << "can not allocate frame buffer.";
+        return nullptr;
+    }
+    AVBufferRef *ref = av_buffer_create(data, bytesPerLine * height, keepImageBuffer, nullptr, 0);
+    if (!ref) {
+        av_free(data);
+        qCWarning(logger) << "can not allocate frame buffer.";
+        return nullptr;
+    }
+    images.append(QImage(data, width, height, bytesPerLine, QImage::Format_RGBA8888_Premultiplied, av_free, data));
+    buffers.append(ref);
+    next = 0;
+    if (buffer) {
+        *buffer = ref;
+    }
+    return &images.last();
+}
+
+void FrameBufferPool::clear()
+{
+    for (AVBufferRef *&ref : buffers) {
+        av_buffer_unref(&ref);
+    }
+    buffers.clear();
+    images.clear();
+    next = 0;
+}
+
+void AVContext::setOutputSize(int width, int height)
+{
+    // 不放大，放大的事情交给 paintEvent()，省得多占内存。
+    width = width > 0 ? qMin(width, codecCtx->width) : codecCtx->width;
+    height = height > 0 ? qMin(height, codecCtx->height) : codecCtx->height;
+    if (width == this->width && height == this->height) {
+        return;
+    }
+    this->width = width;
+    this->height = height;
+    // initSwsContext() makes a new one for the new size.
+    if (swsContext) {
+        sws_freeContext(swsContext);
+        swsContext = nullptr;
+    }
+}
+
+bool AVContext::scale(QImage *image, AVBufferRef *buffer)
+{
+    if (codecCtx->pix_fmt == AV_PIX_FMT_RGBA && width == codecCtx->width && height == codecCtx->height) {
+        // nativeFrame 属于解码器，下次 receive 就会被覆盖。
+        av_image_copy_plane(image->bits(), image->bytesPerLine(), nativeFrame->data[0], nativeFrame->linesize[0],
+                            width * 4, height);
+        return true;
+    }
+    if (!initSwsContext()) {
+        return false;
+    }
+    uint8_t * const dst[4] = { image->bits(), nullptr, nullptr, nullptr };
+    const int dstStride[4] = { image->bytesPerLine(), 0, 0, 0 };
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+    if (scaleThreads != 1) {
+        // sws_scale() 只用一个线程。sws_scale_frame() 才会把一帧切成水平的条带，在 threads 个线程上并行转换。
+        scaledFrame->format = AV_PIX_FMT_RGBA;
+        scaledFrame->width = image->width();
+        scaledFrame->height = image->height();
+        scaledFrame->data[0] = dst[0];
+        scaledFrame->linesize[0] = dstStride[0];
+        // 池里的图像自带一个，录进缓存的和 convertVideoToImages() 的才临时做一个。
+        AVBufferRef *made = nullptr;
+        if (!buffer) {
+            buffer = made = av_buffer_create(dst[0], dstStride[0] * image->height(), keepImageBuffer, nullptr, 0);
+            if (!buffer) {
+                return false;
+            }
+        }
+        scaledFrame->buf[0] = buffer;
+        const int r = sws_scale_frame(swsContext, scaledFrame, nativeFrame);
+        // buf[0] 是借来的，不能让 av_frame_unref() 放掉。
+        scaledFrame->buf[0] = nullptr;
+        av_frame_unref(scaledFrame);
+        av_buffer_unref(&made);
+        return r >= 0;
+    }
+#endif
+    return sws_scale(swsContext, nativeFrame->data, nativeFrame->linesize, 0, codecCtx->height, dst, dstStride) > 0;
+}
+
+int64_t AVContext::framePts(int64_t previous) const
+{
+    // best_effort_timestamp 在没有 pts 的时候会用 dts 猜一个。
+    const int64_t ts = nativeFrame->best_effort_timestamp;
+    if (ts != AV_NOPTS_VALUE) {
+        // edit list 会让开头几帧的 pts 是负的，当作 0。
+        return qMax<int64_t>(static_cast<int64_t>(ts * timeBase * 1000.0), 0);
+    }
+    if (previous < 0) {
+        return 0;
+    }
+    const AVRational rate = formatCtx->streams[videoStream]->avg_frame_rate;
+    return previous + (rate.num > 0 && rate.den > 0 ? qMax<int64_t>(av_rescale(1000, rate.den, rate.num), 1) : 40);
+}
+
+AVContext *makeContext(const QString &url, QString *reason, int threadCount = 0,
+                       int threadType = FF_THREAD_FRAME | FF_THREAD_SLICE)
 {
     QScopedPointer<AVContext> context(new AVContext());
     if (int ret = avformat_open_input(&context->formatCtx, qPrintable(url), nullptr, nullptr)) {
@@ -110,6 +281,8 @@ AVContext *makeContext(const QString &url, QString *reason)
         }
         return nullptr;
     }
+    context->codecCtx->thread_count = threadCount;
+    context->codecCtx->thread_type = threadType;
     if (avcodec_open2(context->codecCtx, nullptr, nullptr)) {
         if (reason) {
             *reason = QString::fromUtf8("can not open codec context.");
@@ -117,105 +290,240 @@ AVContext *makeContext(const QString &url, QString *reason)
         return nullptr;
     }
     context->nativeFrame = av_frame_alloc();
-    AVFrame *rgbFrame = av_frame_alloc();
-    context->rgbFrame = rgbFrame;
-    if (av_image_alloc(rgbFrame->data, rgbFrame->linesize, context->codecCtx->width, context->codecCtx->height,
-                       AV_PIX_FMT_RGBA, 32)
-        < 0) {
-        if (reason) {
-            *reason = QString::fromUtf8("can not allocate rgb frame buffer.");
-        }
-        return nullptr;
+    context->scaledFrame = av_frame_alloc();
+    // 720p 以下一个线程就转换得过来，不值得切分。
+    if (context->codecCtx->width * context->codecCtx->height >= 1280 * 720) {
+        context->scaleThreads = threadCount;
     }
-    context->width = rgbFrame->width = context->codecCtx->width;
-    context->height = rgbFrame->height = context->codecCtx->height;
-    rgbFrame->format = AV_PIX_FMT_RGBA;
+    context->width = context->codecCtx->width;
+    context->height = context->codecCtx->height;
     context->timeBase = av_q2d(stream->time_base);
     return context.take();
 }
 
-DecoderThread::DecoderThread(QObject *viewerPrivate)
+Q_GLOBAL_STATIC(DecodedAnimationCache, decodedAnimations)
+
+DecodedAnimationCache::DecodedAnimationCache()
+    : cache(64 * 1024)
+{
+}
+
+DecodedAnimationCache *DecodedAnimationCache::instance()
+{
+    return decodedAnimations();
+}
+
+QString DecodedAnimationCache::makeKey(const QString &url, int width, int height)
+{
+    // 文件改了就是另一个动画。不是本地文件的话 mtime 是 0。
+    const QFileInfo fileInfo(url);
+    const qint64 mtime = fileInfo.exists() ? fileInfo.lastModified().toMSecsSinceEpoch() : 0;
+    return QString::fromLatin1("%1x%2@%3:").arg(width).arg(height).arg(mtime) + url;
+}
+
+QSharedPointer<DecodedAnimation> DecodedAnimationCache::find(const QString &key)
+{
+    QSharedPointer<DecodedAnimation> animation;
+    mutex.lock();
+    QSharedPointer<DecodedAnimation> *p = cache.object(key);
+    if (p) {
+        animation = *p;
+    }
+    mutex.unlock();
+    return animation;
+}
+
+QSharedPointer<DecodedAnimation> DecodedAnimationCache::insert(const QString &key,
+                                                              const QSharedPointer<DecodedAnimation> &animation)
+{
+    const int cost = static_cast<int>(qMin<qint64>((animation->bytes + 1023) / 1024, INT_MAX));
+    QSharedPointer<DecodedAnimation> result;
+    mutex.lock();
+    if (recordings.value(key).toStrongRef() == animation) {
+        recordings.remove(key);
+    }
+    // 几个 viewer 同时录了同一个动画的话，都用先放进来的那一份，自己的扔掉。
+    QSharedPointer<DecodedAnimation> *p = cache.object(key);
+    if (p) {
+        result = *p;
+    } else if (cache.insert(key, new QSharedPointer<DecodedAnimation>(animation), cost)) {
+        result = animation;
+    }
+    mutex.unlock();
+    return result;
+}
+
+bool DecodedAnimationCache::beginRecording(const QString &key, const QSharedPointer<DecodedAnimation> &recording)
+{
+    bool begun = false;
+    mutex.lock();
+    if (!cache.contains(key) && recordings.value(key).isNull()) {
+        QHash<QString, QWeakPointer<DecodedAnimation>>::iterator it = recordings.begin();
+        while (it != recordings.end()) {
+            if (it.value().isNull()) {
+                it = recordings.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        recordings.insert(key, recording);
+        begun = true;
+    }
+    mutex.unlock();
+    return begun;
+}
+
+void DecodedAnimationCache::setMaxBytes(qint64 bytes)
+{
+    mutex.lock();
+    cache.setMaxCost(static_cast<int>(qBound<qint64>(0, bytes / 1024, INT_MAX)));
+    mutex.unlock();
+}
+
+qint64 DecodedAnimationCache::maxBytes()
+{
+    mutex.lock();
+    const qint64 bytes = static_cast<qint64>(cache.maxCost()) * 1024;
+    mutex.unlock();
+    return bytes;
+}
+
+DecoderSession::DecoderSession(QObject *viewerPrivate)
     : viewerPrivate(viewerPrivate)
+    , frames(MaxFrameBufferSize, BlockingQueue<VideoFrame>::SingleProducerSingleConsumer)
     , state(AnimationViewer::NotParsed)
-    , frameBufferSize(10)
+    , playing(false)
+    , targetWidth(0)
+    , targetHeight(0)
+    , serial(0)
+    , skipUntil(-1)
+    , atEnd(false)
+    , draining(false)
+    , atStart(false)
+    , cachedIndex(0)
+    , lastPts(-1)
     , autoRepeat(false)
     , exiting(false)
+    , started(false)
+    , epoch(0)
+    , priority(Hidden)
+    , runState(DecoderScheduler::Idle)
 {
+    frames.setCapacity(DefaultFrameBufferSize);
+    // play() checks for new commands between every packet.
+    commands.setRelaxedSize(true);
 }
 
-void DecoderThread::run()
+bool DecoderSession::step()
 {
-    bool ready = false;
-    while (!isExiting()) {
-        const Command &cmd = commands.get();
+    Command cmd;
+    while (!isExiting() && commands.tryGet(&cmd)) {
         qCDebug(logger) << "got command:" << cmd.type << cmd.str_arg;
-        switch (cmd.type) {
-        case Command::Invalid:
-            return;
-        case Command::Parse:
-            state = AnimationViewer::NotParsed;
-            if (parse(cmd.str_arg)) {
-                state = AnimationViewer::ParseSuccess;
-            } else {
-                state = AnimationViewer::ParseFailed;
-            }
-            QMetaObject::invokeMethod(viewerPrivate, "parsed", Q_ARG(int, state));
-            break;
-        case Command::Play:
-        play:
-            if (state != AnimationViewer::ParseSuccess) {
-                qCDebug(logger) << "can not play: state=" << state;
-                break;
-            }
-            ready = false;
-            switch (play()) {
-            case Finished:
-                qCDebug(logger) << "play finished.";
-                break;
-            case Ready:
-                qCDebug(logger) << "play ready.";
-                ready = true;
-                break;
-            case Exit:
-                qCDebug(logger) << "play exit.";
-                return;
-            case Error:
-                qCDebug(logger) << "play error.";
-                stop();
-                break;
-            }
-            break;
-        case Command::Stop:
-            stop();
-            break;
-        case Command::Seek:
-            seek(cmd.int_arg1);
-            if (ready) {
-                goto play;
-            } else {
-                break;
-            }
-        case Command::Resize:
-            if (context) {
-                context->width = static_cast<int>(cmd.int_arg1);
-                context->height = static_cast<int>(cmd.int_arg2);
-            }
-            if (ready) {
-                goto play;
-            } else {
-                break;
+        handle(cmd);
+    }
+    if (isExiting()) {
+        // 在 worker 上关掉文件和解码器，gui 线程放掉最后一个引用的时候就不用等它们了。
+        stop();
+        return false;
+    }
+    if (!playing) {
+        return false;
+    }
+    if (state != AnimationViewer::ParseSuccess || atEnd) {
+        // 结束帧已经放进去了，等 seek() 倒回去再播放。
+        qCDebug(logger) << "can not play: state=" << state << "atEnd=" << atEnd;
+        playing = false;
+        return false;
+    }
+    switch (play()) {
+    case Finished:
+        qCDebug(logger) << "play finished.";
+        atEnd = true;
+        playing = false;
+        return false;
+    case Ready:
+        // post() 已经把我们排上了。
+        return false;
+    case Blocked:
+        return false;
+    case Yield:
+        return true;
+    case Exit:
+        qCDebug(logger) << "play exit.";
+        stop();
+        return false;
+    case Error:
+        qCDebug(logger) << "play error.";
+        stop();
+        playing = false;
+        return false;
+    }
+    return false;
+}
+
+void DecoderSession::handle(const Command &cmd)
+{
+    if ((cmd.type == Command::Play || cmd.type == Command::Seek) && cmd.epoch != epoch.loadAcquire()) {
+        qCDebug(logger) << "superseded by a later Parse or Stop:" << cmd.type;
+        return;
+    }
+    switch (cmd.type) {
+    case Command::Invalid:
+        break;
+    case Command::Parse:
+        state = AnimationViewer::NotParsed;
+        playing = false;
+        atEnd = false;
+        draining = false;
+        skipUntil = -1;
+        if (parse(cmd.str_arg, static_cast<int>(cmd.int_arg1), static_cast<int>(cmd.int_arg2))) {
+            context->setOutputSize(targetWidth, targetHeight);
+            url = cmd.str_arg;
+            atStart = true;
+            cacheKey.clear();
+            findCached();
+            state = AnimationViewer::ParseSuccess;
+        } else {
+            state = AnimationViewer::ParseFailed;
+        }
+        QMetaObject::invokeMethod(viewerPrivate, "parsed", Q_ARG(int, state));
+        break;
+    case Command::Play:
+        playing = true;
+        break;
+    case Command::Stop:
+        stop();
+        playing = false;
+        break;
+    case Command::Seek:
+        // 暂停的时候也要解码出新位置的帧给 gui 显示。
+        serial = static_cast<int>(cmd.int_arg3);
+        seek(cmd.int_arg1, cmd.int_arg2 == AnimationViewer::Accurate);
+        playing = true;
+        break;
+    case Command::Resize:
+        targetWidth = static_cast<int>(cmd.int_arg1);
+        targetHeight = static_cast<int>(cmd.int_arg2);
+        if (context) {
+            const bool wasCached = !cached.isNull();
+            context->setOutputSize(targetWidth, targetHeight);
+            findCached();
+            // 缓存和 demuxer 的位置互不相干，换了来源就从最后一帧之后接着播放。
+            if ((wasCached || cached) && !atEnd && lastPts >= 0) {
+                seek(lastPts + 1, true);
             }
-        default:
-            qCWarning(logger) << "unknown command type:";
         }
+        break;
+    default:
+        qCWarning(logger) << "unknown command type:";
     }
 }
 
-bool DecoderThread::parse(const QString &url)
+bool DecoderSession::parse(const QString &url, int threadCount, int threadType)
 {
     Q_ASSERT(!url.isEmpty() && state == AnimationViewer::NotParsed);
     QString reason;
-    QScopedPointer<AVContext> context(makeContext(url, &reason));
+    QScopedPointer<AVContext> context(makeContext(url, &reason, threadCount, threadType));
     if (!context) {
         qCDebug(logger) << reason;
         return false;
@@ -230,11 +538,50 @@ struct ScopedPointerAvPacketDeleter
     static inline void cleanup(AVPacket *&pointer) { av_packet_free(&pointer); }
 };
 
-DecoderThread::PlayResult DecoderThread::play()
+void DecoderSession::findCached()
 {
-    Q_ASSERT(!context.isNull() && context->isValid());
+    const QString key = DecodedAnimationCache::makeKey(url, context->width, context->height);
+    if (key == cacheKey) {
+        return;
+    }
+    cacheKey = key;
+    cached = DecodedAnimationCache::instance()->find(key);
+    // 录下的帧是旧的大小。还没开始播放的话，按新的大小重新录，不用等下一次 seek 到 0。
+    recording.reset();
+    startRecording();
+}
 
-    // 优先处理命令，如果没有命令，则主要去读数据。
+void DecoderSession::startRecording()
+{
+    if (atStart && !cached && isShortClip()) {
+        // 一个动画同时只录一份，别的 viewer 等它录完了从缓存里拿。
+        QSharedPointer<DecodedAnimation> animation(new DecodedAnimation());
+        if (DecodedAnimationCache::instance()->beginRecording(cacheKey, animation)) {
+            recording = animation;
+        }
+    }
+}
+
+bool DecoderSession::isShortClip() const
+{
+    const AVStream *stream = context->formatCtx->streams[context->videoStream];
+    if (context->formatCtx->duration == AV_NOPTS_VALUE || context->formatCtx->duration <= 0) {
+        return false;  // 直播之类的。
+    }
+    int64_t frameCount = stream->nb_frames;
+    if (frameCount <= 0 && stream->avg_frame_rate.num > 0 && stream->avg_frame_rate.den > 0) {
+        frameCount = static_cast<int64_t>(context->formatCtx->duration / static_cast<double>(AV_TIME_BASE)
+                                          * av_q2d(stream->avg_frame_rate));
+    }
+    // 估计不出来就先录着，超了再放弃。
+    const qint64 frameBytes = static_cast<qint64>(FFALIGN(context->width * 4, 32)) * context->height;
+    return frameCount * frameBytes <= DecodedAnimationCache::instance()->maxClipBytes();
+}
+
+DecoderSession::PlayResult DecoderSession::playCached()
+{
+    const QVector<VideoFrame> &all = cached->frames;
+    quint32 budget = frames.capacity();
     while (true) {
         if (isExiting()) {
             return PlayResult::Exit;
@@ -242,41 +589,35 @@ DecoderThread::PlayResult DecoderThread::play()
         if (!commands.isEmpty()) {
             return PlayResult::Ready;
         }
-
-#if (QT_VERSION >= QT_VERSION_CHECK(5, 14, 0))
-        int bsize = frameBufferSize.loadRelaxed();
-#else
-        int bsize = frameBufferSize.load();
-#endif
-        if (frames.size() >= bsize) {
-            return PlayResult::Ready;
+        if (frames.isFull() && frames.overflowPolicy() == BlockingQueue<VideoFrame>::Block) {
+            return PlayResult::Blocked;
         }
-        QScopedPointer<AVPacket, ScopedPointerAvPacketDeleter> packet(av_packet_alloc());
-        if (av_read_frame(context->formatCtx, packet.data())) {
-            frames.put(VideoFrame::makeFinishedFrame());
-            return PlayResult::Finished;
+        if (budget-- == 0) {
+            return PlayResult::Yield;
         }
-
-        if (isExiting()) {
-            return PlayResult::Exit;
+        if (cachedIndex >= all.size()) {
+            frames.put(VideoFrame::makeFinishedFrame(serial));
+            return PlayResult::Finished;
         }
+        const VideoFrame &f = all.at(cachedIndex++);
+        lastPts = f.pts;
+        frames.emplace(f.image, f.pts, f.dts, serial);
+    }
+}
 
-        // 跳过音频等等。。
-        if (packet->stream_index != context->videoStream) {
-            continue;
-        }
-        int r = avcodec_send_packet(context->codecCtx, packet.data());
-        qCDebug(logger) << "发送帧:" << r;
-        if (r != 0) {
-            if (r == AVERROR(EAGAIN)) {
-                qCWarning(logger) << "too much packet.";
-            } else {
-                qCWarning(logger) << "can not send packet.";
-            }
-            return PlayResult::Error;
-        }
+DecoderSession::PlayResult DecoderSession::play()
+{
+    Q_ASSERT(!context.isNull() && context->isValid());
+    // 别的 viewer 已经解码过这个动画了。
+    if (cached) {
+        return playCached();
+    }
 
-        // 上面已经丢了一些帧进去，把所有数据都解码出来再处理其它事。
+    // 优先处理命令，如果没有命令，则主要去读数据。一次最多解码一圈 ring 的帧，然后把 worker 让给别的 session。
+    QScopedPointer<AVPacket, ScopedPointerAvPacketDeleter> packet(av_packet_alloc());
+    quint32 budget = frames.capacity();
+    while (true) {
+        // 上一步可能在解码器里留了帧，把所有数据都解码出来再读新的 packet，不然 send 会返回 EAGAIN。
         while (true) {
             if (isExiting()) {
                 return PlayResult::Exit;
@@ -284,70 +625,219 @@ DecoderThread::PlayResult DecoderThread::play()
             if (!commands.isEmpty()) {
                 return PlayResult::Ready;
             }
-            if (frames.size() >= bsize) {
-                return PlayResult::Ready;
+            if (frames.isFull() && frames.overflowPolicy() == BlockingQueue<VideoFrame>::Block) {
+                return PlayResult::Blocked;
+            }
+            if (budget == 0) {
+                return PlayResult::Yield;
             }
 
-            r = avcodec_receive_frame(context->codecCtx, context->nativeFrame);
+            int r = avcodec_receive_frame(context->codecCtx, context->nativeFrame);
             qCDebug(logger) << "接收帧:" << r;
             if (r == AVERROR(EAGAIN)) {
                 break;
+            } else if (r == AVERROR_EOF) {
+                return finish();
             } else if (r != 0) {
                 return PlayResult::Error;
             } else {  // r == 0
-                AVFrame *t;
-                if (context->codecCtx->pix_fmt == AV_PIX_FMT_RGBA) {
-                    t = context->nativeFrame;
+                // 把 pts 转成以 ms 为单位，省事一些。
+                const int64_t pts = context->framePts(lastPts);
+                if (skipUntil >= 0 && pts < skipUntil) {
+                    // 准确的 seek() 要从关键帧解码到目标位置，前面的帧不用缩放。
+                    continue;
+                }
+                // 直接按窗口大小写到池里的图像，交给 gui 线程的时候不用再复制一遍。
+                const int width = context->width;
+                const int height = context->height;
+                QImage recorded;
+                QImage *image;
+                AVBufferRef *buffer = nullptr;
+                if (recording) {
+                    // 录进缓存的帧不会再回到池里，单独分配。
+                    recorded = QImage(width, height, QImage::Format_RGBA8888_Premultiplied);
+                    image = recorded.isNull() ? nullptr : &recorded;
                 } else {
-                    if (!context->initSwsContext()) {
-                        return PlayResult::Error;
-                    }
-                    if (isExiting()) {
-                        return PlayResult::Exit;
-                    }
-                    int h = sws_scale(context->swsContext, context->nativeFrame->data, context->nativeFrame->linesize,
-                                      0, context->codecCtx->height, context->rgbFrame->data,
-                                      context->rgbFrame->linesize);
-                    if (h <= 0) {
-                        return PlayResult::Error;
-                    }
-
-                    t = context->rgbFrame;
+                    image = framePool.acquire(width, height, &buffer);
+                }
+                if (!image) {
+                    return PlayResult::Error;
+                }
+                if (!context->scale(image, buffer)) {
+                    return PlayResult::Error;
                 }
-                QImage image(reinterpret_cast<const uchar *>(t->data[0]), t->width, t->height, t->linesize[0],
-                             QImage::Format_RGBA8888_Premultiplied);
 
-                // 把 pts 转成以 ms 为单位，省事一些。
-                int64_t pts = static_cast<int64_t>(context->nativeFrame->pts * context->timeBase * 1000.0);
-                VideoFrame vf(image.copy(), pts, context->nativeFrame->pkt_dts);
                 if (isExiting()) {
                     return PlayResult::Exit;
                 }
                 qCDebug(logger) << "解压成功一个帧，放到队列里面。";
-                frames.put(vf);
+                lastPts = pts;
+                atStart = false;
+                if (recording) {
+                    recording->frames.append(VideoFrame(*image, pts, context->nativeFrame->pkt_dts));
+                    recording->bytes += static_cast<qint64>(image->bytesPerLine()) * image->height();
+                    if (recording->bytes > DecodedAnimationCache::instance()->maxClipBytes()) {
+                        recording.reset();
+                    }
+                }
+                frames.emplace(*image, pts, context->nativeFrame->pkt_dts, serial);
+                --budget;
             }
         }
+
+        if (draining) {
+            return finish();
+        }
+        av_packet_unref(packet.data());
+        if (av_read_frame(context->formatCtx, packet.data())) {
+            // 读完了，送一个空的 packet 把解码器里剩下的帧冲出来。帧线程的解码器里可能压着好几帧。
+            avcodec_send_packet(context->codecCtx, nullptr);
+            draining = true;
+            continue;
+        }
+
+        if (isExiting()) {
+            return PlayResult::Exit;
+        }
+
+        // 跳过音频等等。。
+        if (packet->stream_index != context->videoStream) {
+            continue;
+        }
+        if ((packet->flags & AV_PKT_FLAG_KEY) && packet->pts != AV_NOPTS_VALUE) {
+            context->keyFrames.insert(packet->pts, packet->pos);
+        }
+        int r = avcodec_send_packet(context->codecCtx, packet.data());
+        qCDebug(logger) << "发送帧:" << r;
+        if (r != 0) {
+            if (r == AVERROR(EAGAIN)) {
+                qCWarning(logger) << "too much packet.";
+            } else {
+                qCWarning(logger) << "can not send packet.";
+            }
+            return PlayResult::Error;
+        }
     }
 }
 
-void DecoderThread::stop()
+DecoderSession::PlayResult DecoderSession::finish()
+{
+    if (recording) {
+        // 从头到尾都录下来了，以后别的 viewer 和循环播放都用它。
+        cached = DecodedAnimationCache::instance()->insert(cacheKey, recording);
+        if (cached) {
+            cachedIndex = cached->frames.size();
+        }
+        recording.reset();
+    }
+    frames.put(VideoFrame::makeFinishedFrame(serial));
+    return PlayResult::Finished;
+}
+
+void DecoderSession::stop()
 {
     state = AnimationViewer::NotParsed;
     context.reset();
+    framePool.clear();
+    cacheKey.clear();
+    cached.reset();
+    recording.reset();
+    atStart = false;
+    lastPts = -1;
+}
+
+bool DecoderSession::seek(int64_t msecs, bool accurate)
+{
+    atEnd = false;
+    draining = false;
+    atStart = false;
+    skipUntil = -1;
+    recording.reset();
+    if (!context || !context->isValid()) {
+        return false;
+    }
+    if (!cached && !cacheKey.isEmpty()) {
+        // 可能别的 viewer 已经录完了。
+        cached = DecodedAnimationCache::instance()->find(cacheKey);
+    }
+    if (cached) {
+        // 每一帧都在，不用管关键帧。
+        const QVector<VideoFrame> &all = cached->frames;
+        cachedIndex = static_cast<int>(std::lower_bound(all.constBegin(), all.constEnd(), msecs,
+                                                        [](const VideoFrame &f, int64_t pts) { return f.pts < pts; })
+                                       - all.constBegin());
+        return true;
+    }
+    const int64_t target = static_cast<int64_t>(msecs / 1000.0 / context->timeBase);
+    // 看过的关键帧里最近的一个，demuxer 只需要在它和目标之间找。
+    int64_t minTs = INT64_MIN;
+    int64_t keyPos = -1;
+    QMap<int64_t, int64_t>::const_iterator it = context->keyFrames.upperBound(target);
+    if (it != context->keyFrames.constBegin()) {
+        --it;
+        minTs = it.key();
+        keyPos = it.value();
+    }
+    int r = avformat_seek_file(context->formatCtx, context->videoStream, minTs, target, target, 0);
+    if (r < 0 && keyPos >= 0) {
+        // 有些格式不能按时间跳，那就跳到记下来的关键帧的位置。
+        r = av_seek_frame(context->formatCtx, context->videoStream, keyPos, AVSEEK_FLAG_BYTE);
+    }
+    if (r < 0) {
+        qCWarning(logger) << "can not seek to" << msecs;
+        return false;
+    }
+    avcodec_flush_buffers(context->codecCtx);
+    if (accurate) {
+        skipUntil = msecs;
+    }
+    // 从头播放的短动画录下来给别的 viewer 用。
+    atStart = msecs == 0;
+    startRecording();
+    return true;
+}
+
+void DecoderSession::post(Command &&cmd)
+{
+    // 命令按顺序执行，互相不能交换。Parse 和 Stop 让排在它们前面的 Play 和 Seek 作废，合并也不能跨过它们。
+    if (cmd.isBarrier()) {
+        epoch.fetchAndAddOrdered(1);
+    }
+    cmd.epoch = epoch.loadAcquire();
+    const qint64 key = cmd.key();
+    // 打开文件或者开始播放之前，比如先来的 Resize，只排队不占 worker。
+    if (cmd.type == Command::Parse || cmd.type == Command::Play) {
+        started.storeRelease(true);
+    }
+    if (key >= 0) {
+        commands.putCoalesced(std::move(cmd), key);
+    } else {
+        commands.put(std::move(cmd));
+    }
+    schedule();
 }
 
-void DecoderThread::seek(int64_t pts) { }
+void DecoderSession::schedule()
+{
+    if (started.loadAcquire()) {
+        DecoderScheduler::instance()->schedule(sharedFromThis());
+    }
+}
 
-void DecoderThread::shutdown()
+void DecoderSession::shutdown()
 {
 #if (QT_VERSION >= QT_VERSION_CHECK(5, 14, 0))
-    return exiting.storeRelease(true);
+    exiting.storeRelease(true);
 #else
-    return exiting.store(true);
+    exiting.store(true);
 #endif
+    commands.close();
+    frames.close();
+    // a running step() sees exiting between frames. the context is released on a worker, not on the gui thread.
+    schedule();
 }
 
-bool DecoderThread::isExiting() const
+bool DecoderSession::isExiting() const
 {
 #if (QT_VERSION >= QT_VERSION_CHECK(5, 14, 0))
     return exiting.loadAcquire();
@@ -356,30 +846,240 @@ bool DecoderThread::isExiting() const
 #endif
 }
 
+namespace {
+
+class DecoderWorker : public QThread
+{
+public:
+    explicit DecoderWorker(DecoderScheduler *scheduler)
+        : scheduler(scheduler)
+    {
+    }
+    virtual void run() override { scheduler->work(); }
+private:
+    DecoderScheduler * const scheduler;
+};
+
+}  // namespace
+
+Q_GLOBAL_STATIC(DecoderScheduler, decoderScheduler)
+
+DecoderScheduler::DecoderScheduler(int threadCount)
+{
+    const int count = threadCount > 0 ? threadCount : qMax(1, QThread::idealThreadCount());
+    for (int i = 0; i < count; ++i) {
+        workers.append(new DecoderWorker(this));
+    }
+    for (QThread *worker : workers) {
+        worker->start();
+    }
+}
+
+DecoderScheduler::~DecoderScheduler()
+{
+    runnable.close();
+    for (QThread *worker : workers) {
+        worker->wait();
+        delete worker;
+    }
+}
+
+DecoderScheduler *DecoderScheduler::instance()
+{
+    return decoderScheduler();
+}
+
+void DecoderScheduler::schedule(const QSharedPointer<DecoderSession> &session)
+{
+    while (true) {
+        const int state = session->runState.loadAcquire();
+        if (state == Queued || state == RunningAgain) {
+            return;
+        }
+        const int next = state == Idle ? Queued : RunningAgain;
+        if (session->runState.testAndSetOrdered(state, next)) {
+            if (next == Queued) {
+                runnable.put(session, session->priority.loadAcquire());
+            }
+            return;
+        }
+    }
+}
+
+void DecoderScheduler::work()
+{
+    while (true) {
+        QSharedPointer<DecoderSession> session = runnable.take();
+        if (session.isNull()) {
+            return;  // closed.
+        }
+        // 只有拿到它的 worker 会把 Queued 改掉，所以同一个 session 不会在两个 worker 上跑。
+        session->runState.storeRelease(Running);
+        const bool again = session->step();
+        if (!again && session->runState.testAndSetOrdered(Running, Idle)) {
+            continue;
+        }
+        // step() 没做完，或者跑的时候又来了命令、空出了帧的位置，排到同优先级的最后面。
+        session->runState.storeRelease(Queued);
+        runnable.put(session, session->priority.loadAcquire());
+    }
+}
+
+PresentationTicker::PresentationTicker(QObject *parent)
+    : QObject(parent)
+    , nextTick(0)
+    , tickTime(0)
+    , inTick(false)
+{
+    const QScreen *screen = QGuiApplication::primaryScreen();
+    const qreal rate = screen && screen->refreshRate() > 0 ? screen->refreshRate() : 60.0;
+    period = qMax<qint64>(1000000, qRound64(1e9 / rate));
+    timer.setTimerType(Qt::PreciseTimer);
+    timer.setSingleShot(true);
+    connect(&timer, SIGNAL(timeout()), this, SLOT(tick()));
+    clock.start();
+}
+
+PresentationTicker *PresentationTicker::instance()
+{
+    // 跟着 QApplication 一起删掉，那时候 viewer 都已经没了。
+    static QPointer<PresentationTicker> ticker;
+    if (ticker.isNull()) {
+        ticker = new PresentationTicker(QCoreApplication::instance());
+    }
+    return ticker;
+}
+
+void PresentationTicker::subscribe(AnimationViewerPrivate *viewer)
+{
+    if (!viewers.contains(viewer)) {
+        viewers.append(viewer);
+    }
+    // tick() 结束的时候自己会排下一次。
+    if (!inTick && !timer.isActive()) {
+        nextTick = clock.nsecsElapsed() + period;
+        scheduleTick();
+    }
+}
+
+void PresentationTicker::unsubscribe(AnimationViewerPrivate *viewer)
+{
+    viewers.removeOne(viewer);
+    if (viewers.isEmpty()) {
+        timer.stop();
+    }
+}
+
+void PresentationTicker::scheduleTick()
+{
+    // 16.67ms 取整成 17ms 的话每秒会慢一帧，所以每次都按理想的时刻重新算。晚了不补，跳到下一个。
+    const qint64 now = clock.nsecsElapsed();
+    if (nextTick <= now) {
+        nextTick += ((now - nextTick) / period + 1) * period;
+    }
+    timer.start(static_cast<int>((nextTick - now + 999999) / 1000000));
+}
+
+void PresentationTicker::tick()
+{
+    tickTime = clock.elapsed();
+    inTick = true;
+    // next() 会退订自己，finished 信号也可能让别的 viewer 订阅或者被删掉，所以遍历一份拷贝。
+    const QVector<QPointer<AnimationViewerPrivate>> due = viewers;
+    for (const QPointer<AnimationViewerPrivate> &viewer : due) {
+        if (viewer && viewer->ticking && viewer->dueAt <= tickTime) {
+            viewer->next();
+        }
+    }
+    inTick = false;
+    if (!viewers.isEmpty()) {
+        nextTick += period;
+        scheduleTick();
+    }
+}
+
 AnimationViewerPrivate::AnimationViewerPrivate(AnimationViewer *q)
     : q_ptr(q)
-    , thread(new DecoderThread(this))
+    , session(new DecoderSession(this))
+    , ticker(PresentationTicker::instance())
+    , dueAt(0)
+    , clockStart(0)
     , playTime(0)
+    , shownPts(-1)
+    , frameInterval(0)
+    , clockRunning(false)
+    , ticking(false)
+    , occluded(false)
     , autoRepeat(true)
     , pausedBeforeHidden(true)
+    , waitingForFrames(false)
+    , scrubbing(false)
+    , decoderThreadCount(0)
+    , decoderThreading(AnimationViewer::ThroughputThreading)
+    , serial(0)
 {
+    livingViewers.fetchAndAddRelaxed(1);
 #if LIBAVFORMAT_VERSION_INT <= AV_VERSION_INT(58, 9, 100)
     static QAtomicInt registeredFormats(z0);
     if (!registeredFormats.fetchAndAddRelaxed(1)) {
         av_register_all();
     }
 #endif
-    connect(thread, &QThread::finished, thread, &QThread::deleteLater);
-    thread->start();
-    nextFrameTimer.setInterval(10);
-    nextFrameTimer.setSingleShot(false);
-    connect(&nextFrameTimer, SIGNAL(timeout()), this, SLOT(next()));
+    // 队列空了就停掉定时器，等解码线程放进新的帧再通知我们，不再空转轮询。
+    session->frames.setNotifier(this, "framesArrived");
 }
 
 AnimationViewerPrivate::~AnimationViewerPrivate()
 {
-    thread->shutdown();
-    thread = nullptr;
+    stopTicking();
+    session->frames.setNotifier(nullptr, nullptr);
+    session->shutdown();
+    session.reset();
+    livingViewers.fetchAndSubRelaxed(1);
+}
+
+int AnimationViewerPrivate::effectiveDecoderThreadCount() const
+{
+    const int count = decoderThreadCount > 0 ? decoderThreadCount : defaultThreadCount.loadAcquire();
+    if (count > 0) {
+        return count;
+    }
+    // 线程数在打开解码器的时候就定了，按当时的 viewer 数平分的话，先打开的会一直多占。所以只有一个 viewer 的时候
+    // 才用所有的核，多个的时候每个都只在 DecoderScheduler 的 worker 上解码，靠同时解码几个动画用满所有的核，
+    // 线程总数不随 viewer 变多。frame threading 的线程多了只是延迟更大。
+    if (livingViewers.loadAcquire() > 1) {
+        return 1;
+    }
+    return qBound(1, QThread::idealThreadCount(), 16);
+}
+
+void AnimationViewerPrivate::updateDecoderPriority(bool visible)
+{
+    Q_Q(AnimationViewer);
+    if (q->hasFocus()) {
+        session->setPriority(DecoderSession::Focused);
+    } else if (visible) {
+        session->setPriority(DecoderSession::Visible);
+    } else {
+        session->setPriority(DecoderSession::Hidden);
+    }
+}
+
+void AnimationViewerPrivate::startTicking(qint64 delay)
+{
+    dueAt = ticker->now() + qMax<qint64>(delay, 0);
+    if (!ticking) {
+        ticking = true;
+        ticker->subscribe(this);
+    }
+}
+
+void AnimationViewerPrivate::stopTicking()
+{
+    if (ticking) {
+        ticking = false;
+        ticker->unsubscribe(this);
+    }
 }
 
 void AnimationViewerPrivate::parsed(int result)
@@ -387,58 +1087,167 @@ void AnimationViewerPrivate::parsed(int result)
     Q_Q(AnimationViewer);
     AnimationViewer::ParseResult r = static_cast<AnimationViewer::ParseResult>(result);
     if (r != AnimationViewer::ParseSuccess) {
-        playTime = 0;
-        nextFrameTimer.stop();
+        resetClock();
+        stopTicking();
+        waitingForFrames = false;
     }
     emit q->parsed(r);
 }
 
+void AnimationViewerPrivate::startClock(qint64 firstPts)
+{
+    if (!clockRunning) {
+        if (playTime < 0) {
+            playTime = firstPts;
+        }
+        clockStart = ticker->now();
+        clockRunning = true;
+    }
+}
+
+void AnimationViewerPrivate::stopClock()
+{
+    if (clockRunning) {
+        playTime = presentationTime();
+        clockRunning = false;
+    }
+}
+
+void AnimationViewerPrivate::resetClock()
+{
+    playTime = -1;
+    shownPts = -1;
+    frameInterval = 0;
+    clockRunning = false;
+}
+
 void AnimationViewerPrivate::next()
 {
     Q_Q(AnimationViewer);
 
-    BlockingQueue<VideoFrame> &frames = thread->frames;
+    // 这里是 GUI 线程，只能用不会阻塞的 peek() 和 discardWhile()，解码线程慢了就等它通知。
+    // 只有 GUI 线程取帧，先看过不空，peek() 拿到的就是队头。解码线程不会放进无效的帧，真遇到了就停下来，
+    // 不然队列一直是满的，谁也不会再通知我们。
+    // seek() 之前解码的帧都不要了。
+    BlockingQueue<VideoFrame> &frames = session->frames;
+    const int serial = this->serial;
+    if (frames.discardWhile([serial](const VideoFrame &f) { return f.serial != serial; }) > 0) {
+        session->schedule();
+    }
     if (frames.isEmpty()) {
-        qCDebug(logger) << "空队列，再等一会儿。";
+        qCDebug(logger) << "空队列，等解码线程通知。";
+        stopTicking();
+        waitingForFrames = true;
         return;
     }
-
-    VideoFrame f;
-    while (true) {
-        f = frames.get();
-        if (!f.isValid()) {
-            qCDebug(logger) << "不正确的帧。";
-            q->stop();
+    VideoFrame f = frames.peek();
+    if (!f.isValid()) {
+        qCWarning(logger) << "不正确的帧:" << f.pts;
+        q->stop();
+        return;
+    }
+    if (f.serial != serial) {
+        // 刚好在 discardWhile() 之后放进来的旧帧，下次通知的时候再丢。
+        stopTicking();
+        waitingForFrames = true;
+        return;
+    }
+    if (f.isFinished()) {
+        // 最后一帧也要显示够它的时间。
+        const qint64 remaining = clockRunning ? shownPts + frameInterval - presentationTime() : 0;
+        if (remaining > 0) {
+            startTicking(remaining);
             return;
         }
-        if (f.isFinished()) {
-            qCDebug(logger) << "播放结束。";
-            current = QImage();
-            q->update();
-            // XXX 未必需要停止，可以使用 seek() 返回到第 0 帧。
-            // q->stop();
-            emit q->finished();
-            return;
+        stopTicking();
+        frames.tryGet(&f);
+        qCDebug(logger) << "播放结束。";
+        current = QImage();
+        q->update();
+        // XXX 未必需要停止，可以使用 seek() 返回到第 0 帧。
+        // q->stop();
+        emit q->finished();
+        return;
+    }
+
+    // 第一帧到了才开始计时，打开文件和开始解码的时间不算。seek() 以后从新位置的第一帧开始。
+    startClock(f.pts);
+    // 按单调时钟丢弃掉已经晚了的帧，只播放最近一个已经到时间的帧。一次取完，不必一个一个地 get()。
+    const qint64 now = presentationTime();
+    quint32 n = frames.discardWhile(
+            [now](const VideoFrame &f) { return f.isValid() && !f.isFinished() && f.pts <= now; }, &f);
+    if (n > 0) {
+        qCDebug(logger) << "获得一个帧准备开始播放:" << f.pts << now << "丢弃:" << n - 1;
+        // 中间丢掉了 n - 1 帧。
+        // seek() 以后的第一帧前面没有帧，间隔还是按上一帧算，不然会是整个 seek 的距离。
+        if (shownPts >= 0 && f.pts > shownPts) {
+            frameInterval = (f.pts - shownPts) / n;
         }
-        // 丢弃掉一直没有播放的帧，直接从最近一个帧开始播放。
-        // 一直读取到 frames 为空，或者下一帧的播放时间是 playTime 之后，或者下个帧是 EOF 帧
-        if (frames.isEmpty() || frames.peek().pts == 0 || frames.peek().pts > playTime) {
-            break;
+        shownPts = f.pts;
+        current = f.image;
+        if (frames.isEmpty()) {
+            session->post(DecoderSession::Command(DecoderSession::Command::Play));
+        } else {
+            // 空出了位置，被满队列挡住的 session 可以接着解码。
+            session->schedule();
         }
+        if (q->visibleRegion().isEmpty()) {
+            // 看不见就不用重绘，也不用接着走。时钟停住，paintEvent() 说明又露出来了再继续。
+            occluded = true;
+            stopClock();
+            stopTicking();
+            return;
+        }
+        // 不马上重绘，同一次 tick 里所有 viewer 的 update() 合并成一次。
+        q->update();
+    }
+
+    // 到下一帧的 pts 以后的第一次 tick 再叫我们。
+    if (frames.isEmpty()) {
+        qCDebug(logger) << "空队列，等解码线程通知。";
+        stopTicking();
+        waitingForFrames = true;
+        return;
     }
-    qCDebug(logger) << "获得一个帧准备开始播放:" << f.pts << playTime;
-    if (f.pts > playTime) {
-        frames.returnsForcely(f);
-        playTime += nextFrameTimer.interval();
+    f = frames.peek();
+    if (!f.isValid()) {
+        qCWarning(logger) << "不正确的帧:" << f.pts;
+        q->stop();
         return;
     }
-    playTime += nextFrameTimer.interval();
+    startTicking(f.isFinished() ? shownPts + frameInterval - now : f.pts - presentationTime());
+}
+
+void AnimationViewerPrivate::framesArrived()
+{
+    if (scrubbing) {
+        showSeekedFrame();
+        return;
+    }
+    // 暂停或者停止以后的通知不算数。
+    if (!waitingForFrames) {
+        return;
+    }
+    waitingForFrames = false;
+    next();
+}
+
+void AnimationViewerPrivate::showSeekedFrame()
+{
+    Q_Q(AnimationViewer);
+    BlockingQueue<VideoFrame> &frames = session->frames;
+    const int serial = this->serial;
+    if (frames.discardWhile([serial](const VideoFrame &f) { return f.serial != serial; }) > 0) {
+        session->schedule();
+    }
+    const VideoFrame f = frames.peek();
+    if (!f.isValid() || f.serial != serial || f.isFinished()) {
+        return;
+    }
+    // 暂停的时候 seek()，只显示新位置的第一帧。它留在队列里，resume() 以后时钟从它开始走。
+    scrubbing = false;
     current = f.image;
     q->update();
-    if (frames.isEmpty()) {
-        DecoderThread::Command cmd(DecoderThread::Command::Play);
-        thread->commands.put(cmd);
-    }
 }
 
 AnimationViewer::AnimationViewer(QWidget *parent)
@@ -462,55 +1271,163 @@ QString AnimationViewer::url() const
 bool AnimationViewer::isPlaying() const
 {
     Q_D(const AnimationViewer);
-    return d->nextFrameTimer.isActive();
+    return d->ticking || d->waitingForFrames || d->occluded;
+}
+
+void AnimationViewer::setStatisticsEnabled(bool enabled)
+{
+    Q_D(AnimationViewer);
+    d->session->frames.setStatisticsEnabled(enabled);
+    d->session->commands.setStatisticsEnabled(enabled);
+}
+
+BlockingQueueStatistics AnimationViewer::frameStatistics(bool reset) const
+{
+    Q_D(const AnimationViewer);
+    return d->session->frames.statistics(reset);
+}
+
+BlockingQueueStatistics AnimationViewer::commandStatistics(bool reset) const
+{
+    Q_D(const AnimationViewer);
+    return d->session->commands.statistics(reset);
+}
+
+quint64 AnimationViewer::droppedFrames() const
+{
+    Q_D(const AnimationViewer);
+    return d->session->frames.dropped();
+}
+
+void AnimationViewer::setDecoderThreadCount(int count)
+{
+    Q_D(AnimationViewer);
+    d->decoderThreadCount = qMax(count, 0);
+}
+
+int AnimationViewer::decoderThreadCount() const
+{
+    Q_D(const AnimationViewer);
+    return d->decoderThreadCount;
+}
+
+void AnimationViewer::setDecoderThreading(DecoderThreading threading)
+{
+    Q_D(AnimationViewer);
+    d->decoderThreading = threading;
+}
+
+AnimationViewer::DecoderThreading AnimationViewer::decoderThreading() const
+{
+    Q_D(const AnimationViewer);
+    return d->decoderThreading;
+}
+
+void AnimationViewer::setDefaultDecoderThreadCount(int count)
+{
+    defaultThreadCount.storeRelease(qMax(count, 0));
+}
+
+int AnimationViewer::defaultDecoderThreadCount()
+{
+    return defaultThreadCount.loadAcquire();
+}
+
+void AnimationViewer::setSharedFrameCacheSize(qint64 bytes)
+{
+    DecodedAnimationCache::instance()->setMaxBytes(bytes);
+}
+
+qint64 AnimationViewer::sharedFrameCacheSize()
+{
+    return DecodedAnimationCache::instance()->maxBytes();
 }
 
 void AnimationViewer::setUrl(const QString &url)
 {
     Q_D(AnimationViewer);
     d->mediaUrl = url;
-    DecoderThread::Command cmd(DecoderThread::Command::Parse);
+    DecoderSession::Command cmd(DecoderSession::Command::Parse);
     cmd.str_arg = url;
-    d->thread->commands.put(cmd);
+    cmd.int_arg1 = d->effectiveDecoderThreadCount();
+    cmd.int_arg2 = d->decoderThreading == LatencyThreading ? FF_THREAD_SLICE : FF_THREAD_FRAME | FF_THREAD_SLICE;
+    d->session->post(std::move(cmd));
 }
 
 void AnimationViewer::setFrameBufferSize(int size)
 {
     Q_D(AnimationViewer);
-    d->thread->frameBufferSize.storeRelaxed(size);
+    d->session->frames.setCapacity(static_cast<quint32>(qMax(size, 1)));
+}
+
+void AnimationViewer::setLatestFramesOnly(bool latestOnly)
+{
+    Q_D(AnimationViewer);
+    d->session->frames.setOverflowPolicy(latestOnly ? BlockingQueue<VideoFrame>::DropOldest
+                                                   : BlockingQueue<VideoFrame>::Block);
 }
 
 void AnimationViewer::play()
 {
     Q_D(AnimationViewer);
-    DecoderThread::Command cmd(DecoderThread::Command::Play);
-    d->thread->commands.put(cmd);
-    d->playTime = 0;
-    d->nextFrameTimer.start();
+    // 从头开始。循环播放也只是把 demuxer 倒回去，不用重新打开文件。
+    seek(0, NearestKeyFrame);
+    d->session->post(DecoderSession::Command(DecoderSession::Command::Play));
+    d->scrubbing = false;
+    d->occluded = false;
+    d->stopTicking();
+    d->waitingForFrames = true;
 }
 
 void AnimationViewer::stop()
 {
     Q_D(AnimationViewer);
-    DecoderThread::Command cmd(DecoderThread::Command::Stop);
-    d->thread->commands.put(cmd);
-    d->playTime = 0;
-    d->nextFrameTimer.stop();
+    d->session->post(DecoderSession::Command(DecoderSession::Command::Stop));
+    d->resetClock();
+    d->stopTicking();
+    d->waitingForFrames = false;
+    d->occluded = false;
+    d->scrubbing = false;
 }
 
 void AnimationViewer::pause()
 {
     Q_D(AnimationViewer);
-    d->nextFrameTimer.stop();
+    d->stopTicking();
+    d->waitingForFrames = false;
+    d->occluded = false;
+    d->stopClock();
 }
 
 void AnimationViewer::resume()
 {
     Q_D(AnimationViewer);
-    if (d->thread->context.isNull()) {
+    if (d->session->context.isNull() || isPlaying()) {
         return;
     }
-    d->nextFrameTimer.start();
+    d->scrubbing = false;
+    d->startTicking(0);
+}
+
+void AnimationViewer::seek(qint64 msecs, SeekMode mode)
+{
+    Q_D(AnimationViewer);
+    DecoderSession::Command cmd(DecoderSession::Command::Seek);
+    cmd.int_arg1 = qMax<qint64>(msecs, 0);
+    cmd.int_arg2 = mode;
+    cmd.int_arg3 = ++d->serial;
+    d->session->post(std::move(cmd));
+    // 旧位置的帧都不要了，也让被它们堵住的 session 可以继续。时钟从新位置的第一帧开始。
+    d->session->frames.clear();
+    d->session->schedule();
+    d->resetClock();
+    if (isPlaying()) {
+        d->stopTicking();
+        d->occluded = false;
+        d->waitingForFrames = true;
+    } else {
+        d->scrubbing = true;
+    }
 }
 
 void AnimationViewer::setAutoRepeat(bool autoRepeat)
@@ -531,6 +1448,11 @@ void AnimationViewer::paintEvent(QPaintEvent *event)
 {
     Q_D(AnimationViewer);
     QWidget::paintEvent(event);
+    if (d->occluded) {
+        // 又露出来了，从挡住的那一帧接着播放。
+        d->occluded = false;
+        resume();
+    }
     if (d->current.isNull()) {
         return;
     }
@@ -542,18 +1464,20 @@ void AnimationViewer::resizeEvent(QResizeEvent *event)
 {
     Q_D(AnimationViewer);
     QWidget::resizeEvent(event);
-    QSize s = this->size();
-    DecoderThread::Command cmd(DecoderThread::Command::Resize);
+    // 解码直接输出屏幕上的像素大小，paintEvent() 就不用再缩放了。
+    const QSize s = this->size() * devicePixelRatioF();
+    DecoderSession::Command cmd(DecoderSession::Command::Resize);
     cmd.int_arg1 = s.width();
     cmd.int_arg2 = s.height();
-    d->thread->commands.put(cmd);
+    d->session->post(std::move(cmd));
 }
 
 void AnimationViewer::hideEvent(QHideEvent *event)
 {
     Q_D(AnimationViewer);
     QWidget::hideEvent(event);
-    d->pausedBeforeHidden = d->nextFrameTimer.isActive();
+    d->updateDecoderPriority(false);
+    d->pausedBeforeHidden = !isPlaying();
     if (!d->pausedBeforeHidden) {
         pause();
     }
@@ -562,25 +1486,129 @@ void AnimationViewer::showEvent(QShowEvent *event)
 {
     Q_D(AnimationViewer);
     QWidget::showEvent(event);
+    d->updateDecoderPriority(true);
     if (!d->pausedBeforeHidden) {
         resume();
     }
 }
 
+void AnimationViewer::focusInEvent(QFocusEvent *event)
+{
+    Q_D(AnimationViewer);
+    QWidget::focusInEvent(event);
+    d->updateDecoderPriority(isVisible());
+}
+
+void AnimationViewer::focusOutEvent(QFocusEvent *event)
+{
+    Q_D(AnimationViewer);
+    QWidget::focusOutEvent(event);
+    d->updateDecoderPriority(isVisible());
+}
+
 QList<QImage> convertVideoToImages(const QString &filePath, QString *reason)
+{
+    QList<QImage> frames;
+    const bool ok = convertVideoToImages(filePath, ConvertVideoOptions(), [&frames](const QImage &image, qint64) {
+        frames.append(image);
+        return true;
+    }, reason);
+    return ok ? frames : QList<QImage>();
+}
+
+bool convertVideoToImages(const QString &filePath, const ConvertVideoOptions &options, const VideoFrameSink &sink,
+                          QString *reason)
 {
     QScopedPointer<AVContext> context(makeContext(filePath, reason));
     if (!context) {
         if (reason)
             qCDebug(logger) << *reason;
-        return QList<QImage>();
+        return false;
     }
-
-    QList<QImage> frames;
+    if (options.targetSize.isValid()) {
+        const QSize size = QSize(context->codecCtx->width, context->codecCtx->height)
+                                   .scaled(options.targetSize, Qt::KeepAspectRatio);
+        context->setOutputSize(qMax(size.width(), 1), qMax(size.height(), 1));
+    }
+    const int64_t start = qMax<qint64>(options.startMsecs, 0);
+    if (start > 0) {
+        // 从目标之前的关键帧开始解码，之前的帧下面跳过，不用转换。跳不了就从头解码。
+        const int64_t target = static_cast<int64_t>(start / 1000.0 / context->timeBase);
+        if (avformat_seek_file(context->formatCtx, context->videoStream, INT64_MIN, target, target, 0) >= 0) {
+            avcodec_flush_buffers(context->codecCtx);
+        }
+    }
+    // 没给范围就不看 pts，没有 pts 的帧也都要。
+    const bool ranged = start > 0 || options.endMsecs >= 0;
+    const int stride = qMax(options.stride, 1);
+    int64_t lastPts = -1;
+    int inRange = 0;
+    int converted = 0;
+    QImage image;
+    bool draining = false;
+    QScopedPointer<AVPacket, ScopedPointerAvPacketDeleter> packet(av_packet_alloc());
     while (true) {
-        QScopedPointer<AVPacket, ScopedPointerAvPacketDeleter> packet(av_packet_alloc());
+        // 先把解码器里的帧都拿出来，再送下一个 packet。
+        while (true) {
+            if (options.token.isCancelled()) {
+                return true;
+            }
+            int r = avcodec_receive_frame(context->codecCtx, context->nativeFrame);
+            if (r == AVERROR(EAGAIN)) {
+                break;
+            } else if (r == AVERROR_EOF) {
+                return true;
+            } else if (r != 0) {
+                if (reason) {
+                    *reason = QString::fromUtf8("can not decode frame.");
+                }
+                return false;
+            }
+            const int64_t pts = context->framePts(lastPts);
+            lastPts = pts;
+            if (ranged && pts < start) {
+                continue;
+            }
+            if (options.endMsecs >= 0 && pts >= options.endMsecs) {
+                return true;
+            }
+            if (inRange++ % stride != 0) {
+                continue;
+            }
+            // sink 没留下上一帧的话就接着用它的内存。
+            if (image.isNull() || !image.isDetached() || image.width() != context->width
+                || image.height() != context->height) {
+                image = QImage(context->width, context->height, QImage::Format_RGBA8888_Premultiplied);
+                if (image.isNull()) {
+                    if (reason) {
+                        *reason = QString::fromUtf8("out of memory.");
+                    }
+                    return false;
+                }
+            }
+            if (!context->scale(&image)) {
+                if (reason) {
+                    *reason = QString::fromUtf8("can not scale frame.");
+                }
+                return false;
+            }
+            if (!sink(image, pts)) {
+                return true;
+            }
+            if (options.maxFrames > 0 && ++converted >= options.maxFrames) {
+                return true;
+            }
+        }
+        if (draining) {
+            return true;
+        }
+
+        av_packet_unref(packet.data());
         if (av_read_frame(context->formatCtx, packet.data())) {
-            return frames;
+            // 读完了，送一个空的 packet 把解码器里剩下的帧冲出来。
+            avcodec_send_packet(context->codecCtx, nullptr);
+            draining = true;
+            continue;
         }
         if (packet->stream_index != context->videoStream) {
             continue;
@@ -597,42 +1625,7 @@ QList<QImage> convertVideoToImages(const QString &filePath, QString *reason)
                     *reason = QString::fromUtf8("can not send packet.");
                 }
             }
-            return QList<QImage>();
-        }
-
-        while (true) {
-            r = avcodec_receive_frame(context->codecCtx, context->nativeFrame);
-            if (r == AVERROR(EAGAIN)) {
-                break;
-            } else if (r != 0) {
-                if (reason) {
-                    *reason = QString::fromUtf8("can not decode frame.");
-                }
-                return QList<QImage>();
-            } else {
-                context->initSwsContext();
-                int h = sws_scale(context->swsContext, context->nativeFrame->data, context->nativeFrame->linesize, 0,
-                                  context->codecCtx->height, context->rgbFrame->data, context->rgbFrame->linesize);
-                if (h <= 0) {
-                    if (reason) {
-                        *reason = QString::fromUtf8("can not scale frame.");
-                    }
-                    return QList<QImage>();
-                }
-                // 理论上复制 nativeFrame 的数据到 rgbFrame，但实际上我们并不使用 rgbFrame，而是过度一下，丢到
-                // VideoFrame 里面。 所以我们这里就复制了。
-                // rgbFrame->pts = nativeFrame->pts;
-                // rgbFrame->color_trc = nativeFrame->color_trc;
-                // rgbFrame->key_frame = nativeFrame->key_frame;
-                // rgbFrame->pict_type = nativeFrame->pict_type;
-                // rgbFrame->color_range = nativeFrame->color_range;
-                QImage image(static_cast<const uchar *>(context->rgbFrame->data[0]), context->nativeFrame->width,
-                             context->nativeFrame->height, context->rgbFrame->linesize[0],
-                             QImage::Format_RGBA8888_Premultiplied);
-                if (!image.isNull()) {
-                    frames.append(image.copy());
-                }
-            }
+            return false;
         }
     }
 }
@@ -2,6 +2,9 @@
 #define LAFPLAY_ANIMATION_VIEWER_H
 
 #include <QtWidgets/qwidget.h>
+#include <functional>
+#include "blocking_queue_statistics.h"
+#include "cancellation_token.h"
 
 class AnimationViewerPrivate;
 class AnimationViewer: public QWidget
@@ -13,25 +16,61 @@ public:
         ParseFailed = -1,
         NotParsed = 0,
     };
+    enum SeekMode {
+        Accurate = 0,  // show the frame at the position. the decoder runs from the key frame before it.
+        NearestKeyFrame = 1,  // show the key frame before the position, which is much faster.
+    };
+    enum DecoderThreading {
+        // frame and slice threads, the most frames per second. a frame comes out thread count - 1 frames late.
+        ThroughputThreading = 0,
+        // slice threads only, no extra delay. codecs that can not split a frame decode on one thread.
+        LatencyThreading = 1,
+    };
 public:
     explicit AnimationViewer(QWidget *parent = nullptr);
     virtual ~AnimationViewer() override;
 public:
     QString url() const;
     bool isPlaying() const;
+    // counters of the frame and command queues, off by default. many putWaits on frames means the gui is behind,
+    // many getTimeouts means the decoder is, and frames' peakSize shows how much of setFrameBufferSize() is used.
+    void setStatisticsEnabled(bool enabled);
+    BlockingQueueStatistics frameStatistics(bool reset = false) const;
+    BlockingQueueStatistics commandStatistics(bool reset = false) const;
+    quint64 droppedFrames() const;  // see setLatestFramesOnly().
+    // threads of the codec. they are fixed when the codec is opened, so changes apply from the next setUrl().
+    void setDecoderThreadCount(int count);  // 0 by default, which follows setDefaultDecoderThreadCount().
+    int decoderThreadCount() const;
+    void setDecoderThreading(DecoderThreading threading);
+    DecoderThreading decoderThreading() const;
+    // 0 by default: a viewer alone uses every core, while several viewers each decode on one thread of the shared
+    // scheduler, so the number of threads does not grow with the viewers.
+    static void setDefaultDecoderThreadCount(int count);
+    static int defaultDecoderThreadCount();
+    // short clips are decoded once per output size and shared by every viewer playing them. 64 MiB by default, a clip
+    // over a quarter of it is not cached. 0 disables the cache. a clip is recorded while it is decoded from its start
+    // to its end at one size. a viewer playing from the cache still opens the file and the codec, only decoding and
+    // scaling are saved.
+    static void setSharedFrameCacheSize(qint64 bytes);
+    static qint64 sharedFrameCacheSize();
 public slots:
     void setUrl(const QString &url);
     void setFrameBufferSize(int size);
+    // for live sources. the decoder never waits for the frame buffer, it drops the oldest frame instead.
+    void setLatestFramesOnly(bool latestOnly);
     void play();
     void stop();
     void pause();
     void resume();
+    void seek(qint64 msecs, SeekMode mode = Accurate);  // works while playing and while paused.
     void setAutoRepeat(bool autoRepeat);
 protected:
     virtual void paintEvent(QPaintEvent *event) override;
     virtual void resizeEvent(QResizeEvent *event) override;
     virtual void hideEvent(QHideEvent *event) override;
     virtual void showEvent(QShowEvent *event) override;
+    virtual void focusInEvent(QFocusEvent *event) override;
+    virtual void focusOutEvent(QFocusEvent *event) override;
 signals:
     void parsed(ParseResult result);
     void started();
@@ -41,7 +80,34 @@ private:
     Q_DECLARE_PRIVATE_D(dd_ptr, AnimationViewer)
 };
 
-QList<QImage> convertVideoToImages(const QString &filePath, QString *reason);
+QList<QImage> convertVideoToImages(const QString &filePath, QString *reason);  // every frame at full size.
+
+struct ConvertVideoOptions
+{
+    ConvertVideoOptions()
+        : maxFrames(0)
+        , startMsecs(0)
+        , endMsecs(-1)
+        , stride(1)
+    {
+    }
+    int maxFrames;  // stop after this many frames. 0 means no limit.
+    // the frames with startMsecs <= pts < endMsecs. endMsecs < 0 means to the end. the defaults take every frame, even
+    // those without pts.
+    qint64 startMsecs;
+    qint64 endMsecs;
+    QSize targetSize;  // fit in it, keeping the aspect ratio, never larger than the video. invalid means the video size.
+    int stride;  // every stride-th frame of the range, the others are decoded but not converted.
+    CancellationToken token;  // checked between frames.
+};
+
+// pts is in ms. return false to stop. the image is reused for the next frame unless the sink keeps a copy of it.
+typedef std::function<bool(const QImage &image, qint64 pts)> VideoFrameSink;
+
+// hands the frames to sink as they are decoded, nothing is kept. stopping early, by the options, the token or sink,
+// is not an error. returns false and sets reason if the file can not be decoded.
+bool convertVideoToImages(const QString &filePath, const ConvertVideoOptions &options, const VideoFrameSink &sink,
+                          QString *reason);
 
 
 #endif
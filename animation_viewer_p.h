@@ -2,12 +2,21 @@
 #define LAFPLAY_ANIMATION_P_H
 #include <QtCore/qthread.h>
 #include <QtCore/qtimer.h>
+#include <QtCore/qelapsedtimer.h>
 #include <QtCore/qpointer.h>
+#include <QtCore/qsharedpointer.h>
+#include <QtCore/qvector.h>
+#include <QtCore/qmap.h>
+#include <QtCore/qcache.h>
+#include <QtCore/qhash.h>
+#include <QtCore/qmutex.h>
+#include <QtGui/qimage.h>
 #include "blocking_queue.h"
 #include "animation_viewer.h"
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
 #include <libswscale/swscale.h>
 }
 
@@ -18,58 +27,124 @@ public:
     ~AVContext();
     inline bool isValid() const
     {
-        return formatCtx != nullptr && codecCtx != nullptr && nativeFrame != nullptr && rgbFrame != nullptr
+        return formatCtx != nullptr && codecCtx != nullptr && nativeFrame != nullptr && scaledFrame != nullptr
                 && videoStream >= 0 && timeBase > 0;
     }
     bool initSwsContext();
+    // the size of the frames we make, at most the codec size. 0 means the codec size.
+    void setOutputSize(int width, int height);
+    // convert nativeFrame into image, which has the output size. RGBA of the output size is copied as it is. buffer, if
+    // given, wraps the pixels of image, so the threaded path does not make one for every frame.
+    bool scale(QImage *image, AVBufferRef *buffer = nullptr);
+    // the time of nativeFrame in ms. a frame without pts gets the one ffmpeg guesses, or failing that, one frame after
+    // previous by the average frame rate. previous < 0 means it is the first frame.
+    int64_t framePts(int64_t previous) const;
 public:
     AVFormatContext *formatCtx;
     AVCodecContext *codecCtx;
     SwsContext *swsContext;
     AVFrame *nativeFrame;
-    AVFrame *rgbFrame;
+    AVFrame *scaledFrame;  // wraps the image given to scale(), for sws_scale_frame().
+    int scaleThreads;  // 1 converts on the decoder thread, 0 lets swscale choose.
     int videoStream;
-    int width;
+    int width;  // the output size, the codec size is in codecCtx.
     int height;
     double timeBase;
+    // pts to byte position of the key frames read so far, both in the units of the stream. seek() starts from here.
+    QMap<int64_t, int64_t> keyFrames;
 };
 
 class VideoFrame
 {
 public:
-    VideoFrame(const QImage &image, int64_t pts, int64_t dts)
+    VideoFrame(const QImage &image, int64_t pts, int64_t dts, int serial = 0)
         : image(image)
         , pts(pts)
         , dts(dts)
-    {
-    }
-    VideoFrame(const VideoFrame &other)
-        : image(other.image)
-        , pts(other.pts)
-        , dts(other.dts)
+        , serial(serial)
     {
     }
     VideoFrame()
         : pts(-1)
         , dts(-1)
+        , serial(0)
     {
     }
-    static VideoFrame makeFinishedFrame() {
+    static VideoFrame makeFinishedFrame(int serial = 0) {
         VideoFrame f;
         f.dts = INT64_MAX;
         f.pts = INT64_MAX;
+        f.serial = serial;
         return f;
     }
 public:
     bool isFinished() const { return pts == INT64_MAX && dts == INT64_MAX; }
-    bool isValid() const { return pts >= 0 && dts >= 0; }
+    bool isValid() const { return pts >= 0; }  // dts is informative, many streams have none.
 public:
     QImage image;
     int64_t pts;
     int64_t dts;
+    int serial;  // the seek this frame is decoded after. frames from before the last seek are dropped.
+};
+
+// the images the decoder scales into. a slot is reused once every copy handed out is gone, so steady state playback
+// allocates no pixels and the frames reach the gui thread without a copy.
+class FrameBufferPool
+{
+public:
+    FrameBufferPool();
+    ~FrameBufferPool();
+    // an image of the size that nobody else shares, so bits() does not detach. write its pixels, then hand out copies.
+    // the pixels are left from an older frame. buffer gets a reference to them that lives as long as the slot.
+    QImage *acquire(int width, int height, AVBufferRef **buffer = nullptr);
+    void clear();  // drop the slots. images still held by the gui thread free their buffers when they go.
+    inline int size() const { return images.size(); }
+private:
+    QVector<QImage> images;
+    QVector<AVBufferRef *> buffers;  // one for each image, for sws_scale_frame(). it does not own the pixels.
+    int next;  // where acquire() starts looking, the oldest slot is the most likely to be free.
+    int width;
+    int height;
+    Q_DISABLE_COPY(FrameBufferPool)
+};
+
+// every frame of a short clip at one output size. decoded once, then played by every viewer of the clip.
+struct DecodedAnimation
+{
+    DecodedAnimation()
+        : bytes(0)
+    {
+    }
+    QVector<VideoFrame> frames;
+    qint64 bytes;
+};
+
+// process wide, keyed by url, mtime and output size. the least recently used clips are dropped to stay in the budget.
+// a viewer keeps playing a dropped clip, its frames go with its last user.
+class DecodedAnimationCache
+{
+public:
+    DecodedAnimationCache();
+    static DecodedAnimationCache *instance();
+    static QString makeKey(const QString &url, int width, int height);
+public:
+    QSharedPointer<DecodedAnimation> find(const QString &key);
+    // returns the clip cached under key afterwards, which is an earlier one if there is one. null if it is too big.
+    QSharedPointer<DecodedAnimation> insert(const QString &key, const QSharedPointer<DecodedAnimation> &animation);
+    // false if another viewer is recording the clip, it goes to the cache when that viewer gets to the end.
+    bool beginRecording(const QString &key, const QSharedPointer<DecodedAnimation> &recording);
+    void setMaxBytes(qint64 bytes);
+    qint64 maxBytes();
+    inline qint64 maxClipBytes() { return maxBytes() / 4; }  // a longer clip is not worth recording.
+private:
+    QMutex mutex;
+    QCache<QString, QSharedPointer<DecodedAnimation>> cache;  // the cost is in KiB.
+    QHash<QString, QWeakPointer<DecodedAnimation>> recordings;  // in progress. an abandoned one expires by itself.
 };
 
-class DecoderThread : public QThread
+// one animation being decoded. it owns no thread, DecoderScheduler runs step() on a worker whenever there is something
+// to do: a new command, or a free frame slot while playing.
+class DecoderSession : public QEnableSharedFromThis<DecoderSession>
 {
 public:
     struct Command
@@ -86,38 +161,148 @@ public:
         QString str_arg;
         int64_t int_arg1;
         int64_t int_arg2;
+        int64_t int_arg3;
+        quint32 epoch;  // Parse and Stop commands posted before this one, stamped by post().
     public:
         Command()
             : type(Invalid)
+            , epoch(0)
         {
         }
         Command(Type type)
             : type(type)
+            , epoch(0)
         {
         }
         inline bool isValid() const { return type != Invalid; }
+        // commands are taken in the order they were posted. Parse and Stop are barriers: the Play and Seek posted
+        // before them are dropped when taken, they do not overtake them.
+        inline bool isBarrier() const { return type == Parse || type == Stop; }
+        // a queued play/seek/resize is superseded by a newer one of the same type, if no barrier is between them.
+        inline qint64 key() const
+        {
+            switch (type) {
+            case Play:
+            case Seek:
+            case Resize:
+                return static_cast<qint64>(epoch) << 8 | type;
+            default:
+                return -1;
+            }
+        }
+    };
+    enum PlayResult {
+        Finished,
+        Ready,  // a command is queued.
+        Error,
+        Exit,
+        Blocked,  // the frame ring is full. the gui thread schedules us again when it takes a frame.
+        Yield,  // decoded a ring of frames, let the other sessions have the worker.
     };
-    enum PlayResult { Finished, Ready, Error, Exit };
+    // the order in which runnable sessions get a worker.
+    enum Priority { Hidden = 0, Visible = 1, Focused = 2 };
+    // the frame ring is allocated once, setFrameBufferSize() can only choose a capacity below it.
+    enum { MaxFrameBufferSize = 128, DefaultFrameBufferSize = 10 };
 public:
-    explicit DecoderThread(QObject *viewerPrivate);
-    virtual void run() override;
+    explicit DecoderSession(QObject *viewerPrivate);
+    bool step();  // on a worker. handles the queued commands, then decodes a little. true to be run again.
 private:
-    bool parse(const QString &url);
+    void handle(const Command &cmd);
+    bool parse(const QString &url, int threadCount, int threadType);
     PlayResult play();
+    PlayResult playCached();
+    PlayResult finish();  // the last frame is decoded.
+    void findCached();  // look up the cache for the current url and output size.
+    bool isShortClip() const;
+    void startRecording();  // if the clip is short, not cached and decoding is at its start.
     void stop();
-    void seek(int64_t pts);
+    bool seek(int64_t msecs, bool accurate);
 public:
+    void post(Command &&cmd);  // the first Parse or Play starts the session.
+    void schedule();  // after the gui thread takes frames, so a session blocked on a full ring goes on.
     void shutdown();
     inline bool isExiting() const;
+    inline void setPriority(Priority priority) { this->priority.storeRelease(priority); }
 public:
     QPointer<QObject> viewerPrivate;
     QScopedPointer<AVContext> context;
     BlockingQueue<Command> commands;
-    BlockingQueue<VideoFrame> frames;
+    BlockingQueue<VideoFrame> frames;  // the worker puts, gui thread gets.
+    FrameBufferPool framePool;  // worker only, so are the members below up to autoRepeat.
     AnimationViewer::ParseResult state;
-    QAtomicInteger<int> frameBufferSize;
+    bool playing;  // decode whenever there is a free frame slot. set by Play and Seek, cleared at the end.
+    int targetWidth;  // the last Resize, in device pixels. applied to every context we parse.
+    int targetHeight;
+    int serial;  // of the last Seek. stamped on every frame.
+    int64_t skipUntil;  // an accurate seek decodes the frames before its target, but does not scale or queue them.
+    bool atEnd;  // the finished frame is queued. Play does nothing until a seek.
+    bool draining;  // the file is read to the end and the codec is flushed, it gives out its last frames.
+    bool atStart;  // nothing is queued since the file was opened or seeked to 0, a recording started now gets it all.
+    QString url;
+    QString cacheKey;
+    QSharedPointer<DecodedAnimation> cached;  // play() takes frames from here instead of decoding when it is set.
+    int cachedIndex;
+    QSharedPointer<DecodedAnimation> recording;  // the frames decoded from the start, cached at the end.
+    int64_t lastPts;  // of the last frame put, for resuming at another size.
     QAtomicInteger<bool> autoRepeat;
     QAtomicInteger<bool> exiting;
+    QAtomicInteger<bool> started;
+    QAtomicInteger<quint32> epoch;  // of the last barrier posted. the gui thread writes it, the worker reads it.
+    QAtomicInt priority;
+    QAtomicInt runState;  // DecoderScheduler::RunState.
+};
+
+// a fixed pool of workers, as many as the cores, shared by every AnimationViewer. a session is in the run queue at most
+// once, and runs on one worker at a time. focused sessions go first, then visible ones.
+class DecoderScheduler
+{
+public:
+    enum RunState {
+        Idle,
+        Queued,
+        Running,
+        RunningAgain,  // scheduled while running, queue it again when step() returns.
+    };
+public:
+    explicit DecoderScheduler(int threadCount = 0);  // 0 means QThread::idealThreadCount().
+    ~DecoderScheduler();  // lets the running steps finish, then joins the workers.
+    static DecoderScheduler *instance();
+public:
+    void schedule(const QSharedPointer<DecoderSession> &session);
+    inline int threadCount() const { return workers.size(); }
+    void work();  // the loop of a worker.
+private:
+    BlockingQueue<QSharedPointer<DecoderSession>> runnable;
+    QVector<QThread *> workers;
+    Q_DISABLE_COPY(DecoderScheduler)
+};
+
+// 所有 viewer 共用一个按屏幕刷新率走的定时器和时钟。同一次 tick 里的 update() 由 Qt 合并成一次重绘。
+// 只在 gui 线程里用。没有 viewer 在播放的时候定时器是停的。
+class AnimationViewerPrivate;
+class PresentationTicker : public QObject
+{
+    Q_OBJECT
+public:
+    static PresentationTicker *instance();
+public:
+    void subscribe(AnimationViewerPrivate *viewer);
+    void unsubscribe(AnimationViewerPrivate *viewer);
+    // in ms. the same for every viewer during a tick, so they advance together.
+    inline qint64 now() const { return inTick ? tickTime : clock.elapsed(); }
+private slots:
+    void tick();
+private:
+    explicit PresentationTicker(QObject *parent);
+    void scheduleTick();  // start the timer for nextTick.
+private:
+    QTimer timer;  // single shot, restarted for every tick.
+    QElapsedTimer clock;
+    QVector<QPointer<AnimationViewerPrivate>> viewers;
+    qint64 period;  // of the display, in ns.
+    qint64 nextTick;  // in ns of clock. ticks are period apart exactly, the ms rounding of the timer does not add up.
+    qint64 tickTime;
+    bool inTick;
 };
 
 class AnimationViewerPrivate : public QObject
@@ -126,21 +311,49 @@ class AnimationViewerPrivate : public QObject
 public:
     AnimationViewerPrivate(AnimationViewer *q);
     virtual ~AnimationViewerPrivate() override;
+public:
+    // 播放的时钟，以 ms 为单位，和 VideoFrame::pts 比较。
+    inline qint64 presentationTime() const { return clockRunning ? playTime + ticker->now() - clockStart : playTime; }
+    void startClock(qint64 firstPts);
+    void stopClock();  // 暂停，下次 startClock() 从这里接着走。
+    void resetClock();  // 等第一帧到了，从它的 pts 开始走。
+    void showSeekedFrame();
+    int effectiveDecoderThreadCount() const;
+    void updateDecoderPriority(bool visible);  // the order in which our session gets a decoder worker.
+    void startTicking(qint64 delay);  // next() 在 delay ms 以后的第一次 tick 里调用。
+    void stopTicking();
 private slots:
-    // 接收从 DecoderThread 传递过来的状态。
+    // 接收从 DecoderSession 传递过来的状态。
     void parsed(int result);
     // 要求播放下一帧。不过具体啥时候播放还得另外说。
     void next();
+    // frames 从空变为非空时由 BlockingQueue::setNotifier() 投递过来。
+    void framesArrived();
 public:
     AnimationViewer * const q_ptr;
-    DecoderThread *thread;
+    QSharedPointer<DecoderSession> session;
     QImage current;
     QString mediaUrl;
-    QTimer nextFrameTimer;
-    qint64 playTime;
+    PresentationTicker * const ticker;
+    qint64 dueAt;  // ticker->now() from which next() has something to do.
+    qint64 clockStart;  // ticker->now() when the clock was started.
+    qint64 playTime;  // presentationTime() when the clock was started, -1 before the first frame.
+    // the pts of current, -1 if nothing is shown since the clock was reset, and how long the frame before it was shown.
+    // for the last frame.
+    qint64 shownPts;
+    qint64 frameInterval;
+    bool clockRunning;
+    bool ticking;  // subscribed to the ticker.
+    bool occluded;  // 播放的时候被挡住或者滚出了视口，等 paintEvent() 再继续。
     bool autoRepeat;
     bool pausedBeforeHidden;
+    bool waitingForFrames;  // next() 发现队列空了，不订阅 tick，等 framesArrived()。
+    bool scrubbing;  // 暂停的时候 seek() 了，framesArrived() 要显示新位置的第一帧。
+    int decoderThreadCount;
+    AnimationViewer::DecoderThreading decoderThreading;
+    int serial;  // 最后一次 seek() 的编号，和 VideoFrame::serial 对比。
 private:
+    friend class PresentationTicker;
     Q_DECLARE_PUBLIC(AnimationViewer)
 };
 
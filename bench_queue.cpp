@@ -0,0 +1,323 @@
+#include <QtCore/qcoreapplication.h>
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qthread.h>
+#include <QtCore/qvector.h>
+#include <QtCore/qscopedpointer.h>
+#include <QtGui/qimage.h>
+#include <functional>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include "blocking_queue.h"
+#ifdef LAFPLAY_HAS_FFMPEG
+#include "animation_viewer_p.h"
+#endif
+
+// 测量 BlockingQueue 的吞吐和交接延迟。每个配置输出一行 csv，方便和以后的实现对比。
+// --check-scale 不测速度，检查多线程缩放的结果和单线程的逐字节相同，不同就返回 1。
+// usage: lafplay_bench_queue [--ops N] [--quick] [--check-scale]
+
+namespace {
+
+QElapsedTimer benchClock;
+
+template<typename P>
+struct Message
+{
+    Message()
+        : id(0)
+    {
+    }
+    Message(P &&payload, qint64 id)
+        : payload(std::move(payload))
+        , id(id)
+    {
+    }
+    P payload;
+    qint64 id;  // index into the stamps of run().
+};
+
+class Worker : public QThread
+{
+public:
+    explicit Worker(const std::function<void()> &f)
+        : f(f)
+    {
+    }
+    virtual void run() override { f(); }
+private:
+    std::function<void()> f;
+};
+
+struct Payloads
+{
+    Payloads()
+        : image(320, 240, QImage::Format_RGBA8888)
+    {
+        image.fill(Qt::gray);
+    }
+    // the decoder hands over implicitly shared images, so copying one only touches the reference count.
+    inline int make(int i, int *) const { return i; }
+    inline QImage make(int, QImage *) const { return image; }
+#ifdef LAFPLAY_HAS_FFMPEG
+    inline VideoFrame make(int i, VideoFrame *) const { return VideoFrame(image, i, i); }
+#endif
+    QImage image;
+};
+
+struct Result
+{
+    qint64 ops;
+    double seconds;
+    qint64 p50;
+    qint64 p99;
+    qint64 p999;
+    qint64 putP50;
+    qint64 putP99;
+};
+
+qint64 percentile(QVector<qint64> &latencies, double p)
+{
+    if (latencies.isEmpty()) {
+        return 0;
+    }
+    int i = qMin(latencies.size() - 1, static_cast<int>(latencies.size() * p));
+    std::nth_element(latencies.begin(), latencies.begin() + i, latencies.end());
+    return latencies.at(i);
+}
+
+// latency is from put() returning to take() returning, so the time a putter spends blocked on a full queue is not in
+// it. that time is reported on its own as the put percentiles. consumers == 0 runs one thread that puts and takes.
+template<typename P>
+Result run(const Payloads &payloads, typename BlockingQueue<Message<P>>::Mode mode, quint32 capacity, int producers,
+           int consumers, qint64 ops)
+{
+    BlockingQueue<Message<P>> queue(capacity, mode);
+    // every consumer claims an element before taking it, so exactly ops elements are taken.
+    QAtomicInteger<qint64> unclaimed(ops);
+    // benchClock.nsecsElapsed() + 1 when put() returned, 0 before.
+    QScopedArrayPointer<QAtomicInteger<qint64>> stamps(new QAtomicInteger<qint64>[ops]);
+    QVector<QVector<qint64>> latencies(qMax(consumers, 1));
+    QVector<QVector<qint64>> putTimes(producers);
+    auto taken = [&stamps](const Message<P> &m) {
+        const qint64 takenAt = benchClock.nsecsElapsed() + 1;
+        qint64 putAt;
+        // the element can be taken before its putter gets out of put().
+        while ((putAt = stamps[m.id].loadAcquire()) == 0) {
+            QThread::yieldCurrentThread();
+        }
+        return qMax<qint64>(0, takenAt - putAt);
+    };
+    QList<Worker *> workers;
+    qint64 first = 0;
+    for (int i = 0; i < producers; ++i) {
+        const qint64 n = ops / producers + (i < ops % producers ? 1 : 0);
+        QVector<qint64> *putMine = &putTimes[i];
+        putMine->reserve(static_cast<int>(n));
+        QVector<qint64> *mine = consumers == 0 ? &latencies[0] : nullptr;
+        workers.append(new Worker([&queue, &payloads, &stamps, &taken, putMine, mine, first, n] {
+            for (qint64 id = first; id < first + n; ++id) {
+                const qint64 before = benchClock.nsecsElapsed();
+                queue.put(Message<P>(payloads.make(static_cast<int>(id), static_cast<P *>(nullptr)), id));
+                const qint64 after = benchClock.nsecsElapsed();
+                stamps[id].storeRelease(after + 1);
+                putMine->append(after - before);
+                if (mine) {
+                    mine->append(taken(queue.take()));
+                }
+            }
+        }));
+        first += n;
+    }
+    for (int i = 0; i < consumers; ++i) {
+        QVector<qint64> *mine = &latencies[i];
+        mine->reserve(static_cast<int>(ops / consumers + 1));
+        workers.append(new Worker([&queue, &unclaimed, &taken, mine] {
+            while (unclaimed.fetchAndSubOrdered(1) > 0) {
+                mine->append(taken(queue.take()));
+            }
+        }));
+    }
+    QElapsedTimer elapsed;
+    elapsed.start();
+    for (Worker *worker : workers) {
+        worker->start();
+    }
+    for (Worker *worker : workers) {
+        worker->wait();
+        delete worker;
+    }
+    Result result;
+    result.ops = ops;
+    result.seconds = elapsed.nsecsElapsed() / 1e9;
+    QVector<qint64> all;
+    all.reserve(static_cast<int>(ops));
+    for (const QVector<qint64> &l : latencies) {
+        all += l;
+    }
+    result.p50 = percentile(all, 0.5);
+    result.p99 = percentile(all, 0.99);
+    result.p999 = percentile(all, 0.999);
+    all.clear();
+    for (const QVector<qint64> &l : putTimes) {
+        all += l;
+    }
+    result.putP50 = percentile(all, 0.5);
+    result.putP99 = percentile(all, 0.99);
+    return result;
+}
+
+template<typename P>
+void runAll(const Payloads &payloads, const char *payloadName, const QVector<quint32> &capacities,
+            const QVector<int> &threads, qint64 ops)
+{
+    typedef BlockingQueue<Message<P>> Queue;
+    struct Config
+    {
+        const char *name;
+        typename Queue::Mode mode;
+        int producers;
+        int consumers;
+    };
+    QVector<Config> configs;
+    configs.append(Config { "spsc", Queue::SingleProducerSingleConsumer, 1, 1 });
+    for (int n : threads) {
+        // mpmc on 1 thread is the uncontended cost of a put and a take, on 2 threads it is the locked spsc case.
+        configs.append(Config { "mpmc", Queue::MultiProducerMultiConsumer, qMax(n / 2, 1), n - qMax(n / 2, 1) });
+        if (n > 2) {
+            configs.append(Config { "mpsc", Queue::MultiProducerMultiConsumer, n - 1, 1 });
+        }
+    }
+    for (quint32 capacity : capacities) {
+        for (const Config &config : configs) {
+            const Result r = run<P>(payloads, config.mode, capacity, config.producers, config.consumers, ops);
+            printf("%s,%s,%u,%d,%d,%lld,%.6f,%.0f,%lld,%lld,%lld,%lld,%lld\n", config.name, payloadName, capacity,
+                   config.producers, config.consumers, static_cast<long long>(r.ops), r.seconds, r.ops / r.seconds,
+                   static_cast<long long>(r.p50), static_cast<long long>(r.p99), static_cast<long long>(r.p999),
+                   static_cast<long long>(r.putP50), static_cast<long long>(r.putP99));
+            fflush(stdout);
+        }
+    }
+}
+
+#ifdef LAFPLAY_HAS_FFMPEG
+// 同一帧用 sws_scale() 和分条带的 sws_scale_frame() 各转一次，比较每一行的像素。
+bool checkScale(int srcWidth, int srcHeight, int dstWidth, int dstHeight)
+{
+    AVContext context;
+    context.codecCtx = avcodec_alloc_context3(nullptr);
+    context.nativeFrame = av_frame_alloc();
+    context.scaledFrame = av_frame_alloc();
+    if (!context.codecCtx || !context.nativeFrame || !context.scaledFrame) {
+        return false;
+    }
+    context.codecCtx->width = srcWidth;
+    context.codecCtx->height = srcHeight;
+    context.codecCtx->pix_fmt = AV_PIX_FMT_YUV420P;
+    AVFrame *frame = context.nativeFrame;
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = srcWidth;
+    frame->height = srcHeight;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+        return false;
+    }
+    // 起伏不规则的内容，条带边上滤波器的每个抽头都会用到。
+    for (int plane = 0; plane < 3; ++plane) {
+        const int width = plane ? (srcWidth + 1) / 2 : srcWidth;
+        const int height = plane ? (srcHeight + 1) / 2 : srcHeight;
+        for (int y = 0; y < height; ++y) {
+            uint8_t *row = frame->data[plane] + y * frame->linesize[plane];
+            for (int x = 0; x < width; ++x) {
+                row[x] = static_cast<uint8_t>(x * 7 + y * 13 + plane * 61 + (x * y) % 31);
+            }
+        }
+    }
+    context.width = srcWidth;
+    context.height = srcHeight;
+    context.setOutputSize(dstWidth, dstHeight);
+    QImage single(context.width, context.height, QImage::Format_RGBA8888_Premultiplied);
+    QImage sliced(context.width, context.height, QImage::Format_RGBA8888_Premultiplied);
+    context.scaleThreads = 1;
+    if (!context.scale(&single)) {
+        return false;
+    }
+    sws_freeContext(context.swsContext);
+    context.swsContext = nullptr;
+    context.scaleThreads = qMax(QThread::idealThreadCount(), 4);
+    if (!context.scale(&sliced)) {
+        return false;
+    }
+    for (int y = 0; y < single.height(); ++y) {
+        if (memcmp(single.constScanLine(y), sliced.constScanLine(y), static_cast<size_t>(single.width()) * 4) != 0) {
+            fprintf(stderr, "row %d differs.\n", y);
+            return false;
+        }
+    }
+    return true;
+}
+
+int checkScales()
+{
+#if LIBSWSCALE_VERSION_INT < AV_VERSION_INT(6, 1, 100)
+    printf("swscale is older than 6.1, scaling is single threaded.\n");
+#endif
+    struct Case
+    {
+        int srcWidth;
+        int srcHeight;
+        int dstWidth;
+        int dstHeight;
+    };
+    const Case cases[] = {
+        { 1920, 1080, 1920, 1080 },
+        { 1920, 1080, 1280, 720 },
+        { 1920, 1080, 640, 360 },
+        { 1279, 719, 853, 479 },
+        { 3840, 2160, 1920, 1080 },
+    };
+    int failed = 0;
+    printf("src,dst,result\n");
+    for (const Case &c : cases) {
+        const bool same = checkScale(c.srcWidth, c.srcHeight, c.dstWidth, c.dstHeight);
+        printf("%dx%d,%dx%d,%s\n", c.srcWidth, c.srcHeight, c.dstWidth, c.dstHeight, same ? "identical" : "DIFFERENT");
+        failed += same ? 0 : 1;
+    }
+    return failed > 0 ? 1 : 0;
+}
+#endif
+
+}  // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    qint64 ops = 200000;
+    QVector<quint32> capacities = { 1, 16, 256 };
+    QVector<int> threads = { 1, 2, 4, 8, 16 };  // total threads.
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            ops = qMax(1LL, atoll(argv[++i]));
+        } else if (strcmp(argv[i], "--quick") == 0) {
+            ops = 20000;
+            capacities = { 16 };
+            threads = { 1, 4 };
+#ifdef LAFPLAY_HAS_FFMPEG
+        } else if (strcmp(argv[i], "--check-scale") == 0) {
+            return checkScales();
+#endif
+        } else {
+            fprintf(stderr, "usage: %s [--ops N] [--quick] [--check-scale]\n", argv[0]);
+            return 1;
+        }
+    }
+    benchClock.start();
+    Payloads payloads;
+    printf("config,payload,capacity,producers,consumers,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,put_p50_ns,put_p99_ns\n");
+    runAll<int>(payloads, "int", capacities, threads, ops);
+    runAll<QImage>(payloads, "QImage", capacities, threads, ops);
+#ifdef LAFPLAY_HAS_FFMPEG
+    runAll<VideoFrame>(payloads, "VideoFrame", capacities, threads, ops);
+#endif
+    return 0;
+}
@@ -7,7 +7,7 @@ class EventPrivate
 public:
     EventPrivate();
     void set();
-    bool wait(unsigned long time);
+    bool wait(const QDeadlineTimer &deadline);
 public:
     QWaitCondition condition;
     QMutex mutex;
@@ -25,27 +25,29 @@ EventPrivate::EventPrivate()
 void EventPrivate::set()
 {
     // already set true. do nothing.
-    if (flag.fetchAndStoreAcquire(true)) {
+    if (flag.fetchAndStoreOrdered(true)) {
         return;
     }
-    // the flag is changed, wake all waiters.
+    // the flag is changed, wake all waiters. take the mutex so a waiter can not miss it between checking the flag and
+    // starting to wait.
     if (waiters.loadAcquire() > 0) {
+        mutex.lock();
         condition.wakeAll();
+        mutex.unlock();
     }
 }
 
-bool EventPrivate::wait(unsigned long time)
+bool EventPrivate::wait(const QDeadlineTimer &deadline)
 {
     bool f = flag.loadAcquire();
-    if (time == 0 || f) {
+    if (f || deadline.hasExpired()) {
         return f;
     }
 
     mutex.lock();
-    Q_ASSERT(!f);
     ++waiters;
-    while (!(f = flag.loadAcquire())) {
-        condition.wait(&mutex);
+    while (!(f = flag.loadAcquire()) && !deadline.hasExpired()) {
+        condition.wait(&mutex, deadline.isForever() ? ULONG_MAX : static_cast<unsigned long>(deadline.remainingTime()));
     }
     --waiters;
     mutex.unlock();
@@ -77,9 +79,17 @@ void Event::clear()
 }
 
 bool Event::wait(unsigned long time)
+{
+    if (time == ULONG_MAX) {
+        return wait(QDeadlineTimer(QDeadlineTimer::Forever));
+    }
+    return wait(QDeadlineTimer(static_cast<qint64>(time)));
+}
+
+bool Event::wait(const QDeadlineTimer &deadline)
 {
     QSharedPointer<EventPrivate> d = this->d;
-    return d->wait(time);
+    return d->wait(deadline);
 }
 
 bool Event::isSet() const
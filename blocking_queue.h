@@ -1,9 +1,21 @@
 #ifndef LAFPLAY_BLOCKING_QUEUE_H
 #define LAFPLAY_BLOCKING_QUEUE_H
 
-#include <QtCore/qqueue.h>
+#include <QtCore/qlist.h>
 #include <QtCore/qsharedpointer.h>
-#include <QtCore/qreadwritelock.h>
+#include <QtCore/qscopedpointer.h>
+#include <QtCore/qwaitcondition.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qdeadlinetimer.h>
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qobject.h>
+#include <QtCore/qpointer.h>
+#include <QtCore/qbytearray.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include "blocking_queue_statistics.h"
 
 class EventPrivate;
 class Event
@@ -14,18 +26,68 @@ public:
 public:
     void set();
     void clear();
-    bool wait(unsigned long time = ULONG_MAX);
+    bool wait(unsigned long time = ULONG_MAX);  // in msecs. returns false if not set before time.
+    bool wait(const QDeadlineTimer &deadline);
     bool isSet() const;
     quint32 getting() const;
+    // copies share one state, so a copy may be kept by whoever sets it.
+    inline bool operator==(const Event &other) const { return d == other.d; }
 private:
     QSharedPointer<EventPrivate> d;
 };
 
+// sleep until ready() returns true or the deadline is reached, and return ready(). this waits on any number of queues
+// and events at once: event must be a watcher of every queue that ready() looks at, and whatever else ready() depends
+// on must set event when it changes.
+template<typename Predicate>
+bool waitUntil(Event &event, Predicate ready, const QDeadlineTimer &deadline = QDeadlineTimer(QDeadlineTimer::Forever))
+{
+    while (true) {
+        // clear before looking, so a change after ready() leaves the event set.
+        event.clear();
+        if (ready()) {
+            return true;
+        }
+        if (!event.wait(deadline)) {
+            return ready();
+        }
+    }
+}
+
 template<typename T>
 class BlockingQueue
 {
 public:
-    explicit BlockingQueue(quint32 capacity);
+    enum Mode {
+        // any thread may put() and get(). blocked threads wait in line, and every element or free slot wakes exactly
+        // the first one of them.
+        MultiProducerMultiConsumer = 0,
+        // one thread puts and one other thread gets. elements are kept in a ring preallocated to capacity, and the
+        // indexes are atomics, so neither side takes a lock unless it has to sleep. returns(), peek(), remove(),
+        // contains() and clear() belong to the getting thread.
+        SingleProducerSingleConsumer = 1,
+    };
+    // what put() does with a full queue. returns(), putForcedly() and returnsForcely() are not affected.
+    enum OverflowPolicy {
+        Block = 0,  // wait for a free slot.
+        DropOldest = 1,  // remove the head of queue, then insert e.
+        DropNewest = 2,  // discard e, and return false.
+        ReplaceTail = 3,  // e takes the place of the last element.
+    };
+    // names one element put by putWithHandle() while it is queued. a default constructed handle names nothing.
+    struct Handle
+    {
+        Handle()
+            : index(0)
+            , generation(0)
+        {
+        }
+        inline bool isValid() const { return generation != 0; }
+        quint32 index;
+        quint32 generation;
+    };
+public:
+    explicit BlockingQueue(quint32 capacity, Mode mode = MultiProducerMultiConsumer);
     BlockingQueue()
         : BlockingQueue(UINT_MAX)
     {
@@ -33,14 +95,84 @@ public:
     ~BlockingQueue();
 public:
     void setCapacity(quint32 capacity);
+    // size(), isEmpty() and isFull() read an atomic counter instead of taking the lock. the answer may be one
+    // concurrent put() or get() behind, which is fine for polling. SingleProducerSingleConsumer always does this.
+    void setRelaxedSize(bool relaxed);
+    // Block by default. with DropOldest and ReplaceTail the SingleProducerSingleConsumer ring lets the putting thread
+    // move the head, so both threads take a short lock to touch it. call this from the getting thread in that mode.
+    void setOverflowPolicy(OverflowPolicy policy);
+    inline OverflowPolicy overflowPolicy() const { return static_cast<OverflowPolicy>(overflow.loadAcquire()); }
+    inline quint64 dropped() const { return droppedCount.loadAcquire(); }  // elements discarded by the policy.
     bool put(const T &e);  // insert e to the tail of queue. blocked until not full.
     bool putForcedly(const T &e);  // insert e to the tail of queue ignoring capacity.
     bool returns(const T &e);  // like put() but insert e to the head of queue.
     bool returnsForcely(const T &e);  // like putForcedly() but insert e to the head of queue.
-    T get();
-    T peek();
+    // the rvalue versions move e all the way to the getter, so T may be a move-only type.
+    bool put(T &&e);
+    bool putForcedly(T &&e);
+    bool returns(T &&e);
+    bool returnsForcely(T &&e);
+    template<typename... Args>
+    bool emplace(Args &&...args);  // like put() but construct the element from args.
+    // insert e after every element of the same or higher priority, so the most urgent element is taken first and
+    // elements of one priority keep their order. put(e) is put(e, 0). the SingleProducerSingleConsumer ring is plain
+    // FIFO and ignores priority.
+    bool put(const T &e, int priority);
+    bool put(T &&e, int priority);
+    // latest value wins. if an element put with the same key (>= 0) is still queued, e replaces it in place and the
+    // queue does not grow, otherwise this is put(e, priority). the SingleProducerSingleConsumer ring does not coalesce.
+    bool putCoalesced(const T &e, qint64 key, int priority = 0);
+    bool putCoalesced(T &&e, qint64 key, int priority = 0);
+    // like put(e, priority), and name the queued element in handle so that cancel() can remove it in O(1). the handle
+    // names nothing if e went straight to a waiting getter, or in SingleProducerSingleConsumer mode.
+    bool putWithHandle(const T &e, Handle *handle, int priority = 0);
+    bool putWithHandle(T &&e, Handle *handle, int priority = 0);
+    bool cancel(const Handle &handle);  // returns false if the element was got or removed already.
+    T take();  // remove the head of queue and move it out. blocked until not empty.
+    T get() { return take(); }
+    T peek();  // copy the head of queue, T must be copyable.
+public:
+    // these never wait past the deadline, and return false if it is reached first. tryPut() and tryGet() do not wait
+    // at all. out is left untouched on failure.
+    bool tryPut(const T &e);
+    bool tryPut(T &&e);
+    bool putUntil(const T &e, const QDeadlineTimer &deadline);
+    bool putUntil(T &&e, const QDeadlineTimer &deadline);
+    bool tryGet(T *out);
+    bool getFor(T *out, qint64 msecs);
+    bool getUntil(T *out, const QDeadlineTimer &deadline);
     void clear();
     bool remove(const T &e);
+    // wake every blocked thread and refuse new elements from now on: put() and friends return false at once, and
+    // get() and friends return false, or T() from take(), as soon as the elements left are drained. may be called
+    // from any thread, also in SingleProducerSingleConsumer mode. there is no way to reopen.
+    void close();
+    inline bool isClosed() const { return closed.loadAcquire(); }
+public:
+    // see waitUntil(). a readable watcher is set when elements are added, a writable one when elements are removed or
+    // the capacity is changed, and both when the queue is closed.
+    void addReadableWatcher(const Event &event);
+    void addWritableWatcher(const Event &event);
+    void removeWatcher(const Event &event);
+    // for consumers in an event loop, like the gui thread. once the queue holds at least watermark elements, a queued
+    // call of receiver's member (a slot name, as for QMetaObject::invokeMethod()) is posted. calls are coalesced: no
+    // other is posted until the queue drops below watermark, so the receiver should take until it does. pass nullptr
+    // to stop, and do so before the receiver is deleted.
+    void setNotifier(QObject *receiver, const char *member, quint32 watermark = 1);
+public:
+    // the batch operations take the lock once and wake each waiter once, whatever the number of elements.
+    // a putMany() that finds the queue full waits for space like put() does, and the lock is released while it
+    // waits, so a blocking batch is not atomic: elements of other putters may land between its elements.
+    template<typename Container>
+    quint32 putMany(const Container &elements);  // put() every element in order. returns the number inserted.
+    template<typename Container>
+    quint32 getUpTo(quint32 n, Container *out);  // blocked until not empty, then append at most n elements to out.
+    template<typename Container>
+    quint32 drainTo(Container *out);  // append all elements to out without blocking.
+    // remove elements from the head while predicate(e) is true, without blocking. the last removed element is
+    // stored in lastDiscarded if given.
+    template<typename Predicate>
+    quint32 discardWhile(Predicate predicate, T *lastDiscarded = nullptr);
 public:
     inline bool isEmpty();
     inline bool isFull();
@@ -48,21 +180,316 @@ public:
     inline quint32 size() const;
     inline quint32 getting() const;
     inline bool contains(const T &e);
+    inline Mode mode() const { return mMode; }
+public:
+    // off by default, the disabled queue only pays for checking the flag.
+    void setStatisticsEnabled(bool enabled);
+    inline bool isStatisticsEnabled() const { return statisticsEnabled.loadAcquire(); }
+    BlockingQueueStatistics statistics(bool reset = false);  // snapshot, and start over from zero if reset.
+    void resetStatistics() { statistics(true); }
+private:
+    struct Getter
+    {
+        Getter()
+            : done(false)
+        {
+        }
+        QWaitCondition condition;
+        T e;
+        bool done;
+    };
+    struct Putter
+    {
+        Putter(T *e, bool atHead, int priority, qint64 key, Handle *handle)
+            : e(e)
+            , atHead(atHead)
+            , priority(priority)
+            , key(key)
+            , handle(handle)
+            , done(false)
+        {
+        }
+        QWaitCondition condition;
+        T *e;  // moved into the queue when admitted.
+        bool atHead;
+        int priority;
+        qint64 key;
+        Handle *handle;
+        bool done;
+    };
+    // MultiProducerMultiConsumer storage. elements live in slots that are reused through a free list, and the order
+    // of queue is a growable ring of slot indexes, so returns() and get() are O(1) and nothing is moved but indexes.
+    // cancel() only marks a slot dead. a dead index is dropped when it reaches either end, or all at once when the
+    // dead outnumber the live.
+    class Storage
+    {
+    public:
+        struct Slot
+        {
+            Slot()
+                : priority(0)
+                , key(-1)
+                , generation(1)
+                , live(false)
+            {
+            }
+            T e;
+            int priority;
+            qint64 key;  // -1 if not put by putCoalesced().
+            quint32 generation;  // changed whenever the slot stops being live, so old handles miss.
+            bool live;
+        };
+    public:
+        Storage();
+        void reserve(quint32 n);
+        inline quint32 size() const { return liveCount; }
+        inline bool isEmpty() const { return liveCount == 0; }
+        Slot &first();  // the queue must not be empty.
+        Slot &last();
+        T takeFirst();
+        void removeFirst();
+        void removeLast();
+        // insert before the first element of lower priority, or at the head. returns the slot index.
+        template<typename... Args>
+        quint32 insert(bool atHead, int priority, qint64 key, Args &&...args);
+        bool cancel(quint32 index, quint32 generation);
+        template<typename Predicate>
+        quint32 removeIf(Predicate predicate);
+        template<typename Predicate>
+        Slot *findIf(Predicate predicate);  // the first live slot from the head that predicate(slot) accepts.
+        void clear();
+        inline quint32 generation(quint32 index) const { return slots[index].generation; }
+    private:
+        inline quint32 &at(quint32 i) { return order[(orderHead + i) & orderMask]; }
+        quint32 allocate();
+        void kill(Slot &slot);
+        void grow();
+        void compact();
+        void trim();
+    private:
+        std::vector<Slot> slots;
+        std::vector<quint32> freeSlots;
+        std::vector<quint32> order;  // power of two sized, orderSize indexes from orderHead.
+        quint32 orderHead;
+        quint32 orderSize;
+        quint32 orderMask;
+        quint32 liveCount;
+        quint32 deadCount;
+    };
+    // with mutex locked. e is moved from unless the deadline is reached first.
+    bool insert(T &e, bool atHead, bool forcedly, int priority = 0,
+                const QDeadlineTimer &deadline = QDeadlineTimer::Forever, qint64 key = -1, Handle *handle = nullptr);
+    void admitPutters();
+    // with mutex locked, ignoring capacity. returns the slot index.
+    template<typename... Args>
+    quint32 push(bool atHead, int priority, qint64 key, Args &&...args);
+    bool replace(T &e, qint64 key);  // with mutex locked. move e over the queued element with key.
+    inline void setHandle(Handle *handle, quint32 index)
+    {
+        if (handle) {
+            handle->index = index;
+            handle->generation = queue.generation(index);
+        }
+    }
+    T pop();  // with mutex locked, the queue must not be empty.
+    static inline unsigned long waitTime(const QDeadlineTimer &deadline)
+    {
+        return deadline.isForever() ? ULONG_MAX : static_cast<unsigned long>(deadline.remainingTime());
+    }
+    inline void updateCount()
+    {
+        const quint32 size = queue.size();
+        const quint32 old = count.loadAcquire();  // only written with mutex locked.
+        count.storeRelease(size);
+        if (statisticsEnabled.loadAcquire()) {
+            recordSize(size);
+        }
+        if (size != old) {
+            notifyWatchers(size > old, size < old);
+        }
+    }
+    inline void notifyWatchers(bool readable, bool writable)
+    {
+        if (watcherCount.loadAcquire() > 0 || (notifying.loadAcquire() && notifierChanges(readable, writable))) {
+            setWatchers(readable, writable);
+        }
+    }
+    // without taking watcherMutex, so a steady stream under the notifier neither locks nor posts.
+    inline bool notifierChanges(bool readable, bool writable)
+    {
+        // the putter stores the element then loads notifyPending, the receiver clears notifyPending then looks for
+        // elements. one of them sees the other.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const bool pending = notifyPending.loadAcquire();
+        const bool below = approximateSize() < notifyWatermark.loadAcquire();
+        return (readable && !pending && !below) || (writable && pending && below);
+    }
+    void setWatchers(bool readable, bool writable);
+    // count without taking the lock. MultiProducerMultiConsumer updates it with the lock held.
+    inline quint32 approximateSize() const { return mMode == SingleProducerSingleConsumer ? size() : count.loadAcquire(); }
+private:
+    inline void lock(QMutex *m)
+    {
+        if (!statisticsEnabled.loadAcquire()) {
+            m->lock();
+        } else if (!m->tryLock()) {
+            contentions.fetchAndAddRelaxed(1);
+            m->lock();
+        }
+    }
+    inline qint64 waitStarted() const { return statisticsEnabled.loadAcquire() ? clock.nsecsElapsed() : -1; }
+    inline void waitFinished(qint64 since, QAtomicInteger<quint64> *waits, QAtomicInteger<quint64> *nsecs)
+    {
+        if (since >= 0) {
+            waits->fetchAndAddRelaxed(1);
+            nsecs->fetchAndAddRelaxed(static_cast<quint64>(clock.nsecsElapsed() - since));
+        }
+    }
+    inline void recordPut(quint32 n)
+    {
+        if (n > 0 && statisticsEnabled.loadAcquire()) {
+            enqueued.fetchAndAddRelaxed(n);
+            if (mMode == SingleProducerSingleConsumer) {
+                recordSize(size());
+            }
+        }
+    }
+    inline void recordGet(quint32 n)
+    {
+        if (n > 0 && statisticsEnabled.loadAcquire()) {
+            dequeued.fetchAndAddRelaxed(n);
+        }
+    }
+    inline void recordTimeout(QAtomicInteger<quint64> *timeouts)
+    {
+        if (statisticsEnabled.loadAcquire()) {
+            timeouts->fetchAndAddRelaxed(1);
+        }
+    }
+    void recordSize(quint32 size);
+private:
+    bool ringPut(T &e, bool forcedly, const QDeadlineTimer &deadline = QDeadlineTimer::Forever);
+    bool ringWaitForSpace(quint32 t, bool forcedly, const QDeadlineTimer &deadline = QDeadlineTimer::Forever);
+    bool ringWaitForElement(quint32 h, const QDeadlineTimer &deadline = QDeadlineTimer::Forever);
+    bool ringOverflow(T &e, quint32 t, bool *accepted);
+    inline bool lockRingHead()
+    {
+        const int policy = overflow.loadAcquire();
+        if (policy == DropOldest || policy == ReplaceTail) {
+            lock(&headMutex);
+            return true;
+        }
+        return false;
+    }
+    bool ringReturns(T &e);
+    bool ringGet(T *out, const QDeadlineTimer &deadline);
+    T ringPeek();
+    void ringClear();
+    bool ringRemove(const T &e);
+    bool ringContains(const T &e);
+    void ringWakeGetter();
+    void ringWakePutter();
 private:
-    QQueue<T> queue;
-    Event notEmpty;
-    Event notFull;
-    QReadWriteLock lock;
-    quint32 mCapacity;
+    // MultiProducerMultiConsumer. while getters is not empty the queue is empty, and while putters is not empty the
+    // queue is full, so a put() or a free slot can always be handed to the first waiter directly. the queue is sorted
+    // by priority, from high to low.
+    Storage queue;
+    QList<Getter *> getters;
+    QList<Putter *> putters;
+    QMutex mutex;
+    QAtomicInteger<quint32> count;
+    QAtomicInteger<bool> relaxedSize;
+    QAtomicInteger<quint32> mCapacity;
+    QAtomicInteger<int> overflow;
+    QAtomicInteger<quint64> droppedCount;
+    QAtomicInteger<bool> closed;
+    const Mode mMode;
+
+    // SingleProducerSingleConsumer. head and tail are free running, the slot is `index & ringMask`.
+    QScopedArrayPointer<T> ring;
+    quint32 ringMask;
+    QAtomicInteger<quint32> head;  // written by the getting thread only.
+    QAtomicInteger<quint32> tail;  // written by the putting thread only.
+    std::deque<T> returned;  // elements given back by returns(), owned by the getting thread.
+    QAtomicInteger<quint32> returnedCount;
+    QAtomicInteger<bool> ringGetting;
+    QAtomicInteger<bool> ringPutting;
+    QMutex parkingMutex;  // only taken by a thread going to sleep or waking the other one.
+    QWaitCondition ringNotEmpty;
+    QWaitCondition ringNotFull;
+    QMutex headMutex;  // see setOverflowPolicy().
+
+    // statistics. the counters are atomics because the two sides of the ring count without a lock.
+    QAtomicInteger<bool> statisticsEnabled;
+    QAtomicInteger<quint64> enqueued;
+    QAtomicInteger<quint64> dequeued;
+    QAtomicInteger<quint64> putWaits;
+    QAtomicInteger<quint64> putWaitNsecs;
+    QAtomicInteger<quint64> getWaits;
+    QAtomicInteger<quint64> getWaitNsecs;
+    QAtomicInteger<quint64> putTimeouts;
+    QAtomicInteger<quint64> getTimeouts;
+    QAtomicInteger<quint64> contentions;
+    QAtomicInteger<quint32> peakSize;
+    QElapsedTimer clock;
+
+    QList<Event> readableWatchers;
+    QList<Event> writableWatchers;
+    QPointer<QObject> notifyReceiver;
+    QByteArray notifyMember;
+    QAtomicInteger<quint32> notifyWatermark;
+    QAtomicInteger<bool> notifyPending;  // a call is posted and the queue has not dropped below the watermark since.
+    QMutex watcherMutex;  // guards the watchers and the notifier.
+    QAtomicInteger<quint32> watcherCount;  // the events, not the notifier.
+    QAtomicInteger<bool> notifying;  // a notifier is set.
     Q_DISABLE_COPY(BlockingQueue)
 };
 
 template<typename T>
-BlockingQueue<T>::BlockingQueue(quint32 capacity)
-    : mCapacity(capacity)
+BlockingQueue<T>::BlockingQueue(quint32 capacity, Mode mode)
+    : count(0)
+    , relaxedSize(false)
+    , mCapacity(capacity)
+    , overflow(Block)
+    , droppedCount(0)
+    , closed(false)
+    , mMode(mode)
+    , ringMask(0)
+    , head(0)
+    , tail(0)
+    , returnedCount(0)
+    , ringGetting(false)
+    , ringPutting(false)
+    , statisticsEnabled(false)
+    , enqueued(0)
+    , dequeued(0)
+    , putWaits(0)
+    , putWaitNsecs(0)
+    , getWaits(0)
+    , getWaitNsecs(0)
+    , putTimeouts(0)
+    , getTimeouts(0)
+    , contentions(0)
+    , peakSize(0)
+    , notifyWatermark(1)
+    , notifyPending(false)
+    , watcherCount(0)
+    , notifying(false)
 {
-    notEmpty.clear();
-    notFull.set();
+    clock.start();
+    if (mode == SingleProducerSingleConsumer) {
+        // the ring can not grow without stopping both sides, so it is allocated once.
+        Q_ASSERT(capacity > 0 && capacity <= (1u << 20));
+        quint32 ringSize = 2;
+        while (ringSize < capacity) {
+            ringSize <<= 1;
+        }
+        ring.reset(new T[ringSize]);
+        ringMask = ringSize - 1;
+    } else if (capacity != UINT_MAX) {
+        // a bounded queue never needs more slots than its capacity. very large ones grow on demand instead.
+        queue.reserve(qMin(capacity, 4096u));
+    }
 }
 
 template<typename T>
@@ -74,178 +501,1404 @@ BlockingQueue<T>::~BlockingQueue()
 }
 
 template<typename T>
-void BlockingQueue<T>::setCapacity(quint32 capacity)
+BlockingQueue<T>::Storage::Storage()
+    : order(8)
+    , orderHead(0)
+    , orderSize(0)
+    , orderMask(7)
+    , liveCount(0)
+    , deadCount(0)
+{
+}
+
+template<typename T>
+void BlockingQueue<T>::Storage::reserve(quint32 n)
 {
-    lock.lockForWrite();
-    this->mCapacity = capacity;
-    if (static_cast<quint32>(queue.size()) >= mCapacity) {
-        notFull.clear();
+    while (slots.size() < n) {
+        freeSlots.push_back(static_cast<quint32>(slots.size()));
+        slots.emplace_back();
+    }
+    while (orderMask + 1 < n) {
+        grow();
+    }
+}
+
+template<typename T>
+typename BlockingQueue<T>::Storage::Slot &BlockingQueue<T>::Storage::first()
+{
+    trim();
+    return slots[at(0)];
+}
+
+template<typename T>
+typename BlockingQueue<T>::Storage::Slot &BlockingQueue<T>::Storage::last()
+{
+    trim();
+    return slots[at(orderSize - 1)];
+}
+
+template<typename T>
+T BlockingQueue<T>::Storage::takeFirst()
+{
+    Slot &slot = first();
+    T e(std::move(slot.e));
+    removeFirst();
+    return e;
+}
+
+template<typename T>
+void BlockingQueue<T>::Storage::removeFirst()
+{
+    kill(first());
+    trim();
+}
+
+template<typename T>
+void BlockingQueue<T>::Storage::removeLast()
+{
+    kill(last());
+    trim();
+}
+
+template<typename T>
+template<typename... Args>
+quint32 BlockingQueue<T>::Storage::insert(bool atHead, int priority, qint64 key, Args &&...args)
+{
+    const quint32 index = allocate();
+    Slot &slot = slots[index];
+    slot.e = T(std::forward<Args>(args)...);
+    slot.key = key;
+    slot.live = true;
+    if (orderSize == orderMask + 1) {
+        grow();
+    }
+    trim();
+    if (atHead) {
+        // returned elements go before everything, so take the priority of the head to keep the queue sorted.
+        slot.priority = orderSize == 0 ? priority : qMax(priority, slots[at(0)].priority);
+        orderHead = (orderHead - 1) & orderMask;
+        at(0) = index;
+    } else if (orderSize == 0 || slots[at(orderSize - 1)].priority >= priority) {
+        slot.priority = priority;
+        at(orderSize) = index;
     } else {
-        notFull.set();
+        slot.priority = priority;
+        // before the first element of lower priority. dead slots keep their priority, so the order is still sorted.
+        quint32 low = 0, high = orderSize;
+        while (low < high) {
+            const quint32 middle = low + (high - low) / 2;
+            if (slots[at(middle)].priority >= priority) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        // move the shorter side.
+        if (low < orderSize / 2) {
+            orderHead = (orderHead - 1) & orderMask;
+            for (quint32 i = 0; i < low; ++i) {
+                at(i) = at(i + 1);
+            }
+        } else {
+            for (quint32 i = orderSize; i > low; --i) {
+                at(i) = at(i - 1);
+            }
+        }
+        at(low) = index;
     }
-    lock.unlock();
+    ++orderSize;
+    ++liveCount;
+    return index;
 }
 
 template<typename T>
-void BlockingQueue<T>::clear()
+bool BlockingQueue<T>::Storage::cancel(quint32 index, quint32 generation)
 {
-    lock.lockForWrite();
-    this->queue.clear();
-    notFull.set();
-    notEmpty.clear();
-    lock.unlock();
+    if (index >= slots.size() || slots[index].generation != generation || !slots[index].live) {
+        return false;
+    }
+    kill(slots[index]);
+    trim();
+    if (deadCount > 32 && deadCount > liveCount) {
+        compact();
+    }
+    return true;
 }
 
 template<typename T>
-bool BlockingQueue<T>::remove(const T &e)
+template<typename Predicate>
+quint32 BlockingQueue<T>::Storage::removeIf(Predicate predicate)
 {
-    lock.lockForWrite();
-    int n = this->queue.removeAll(e);
+    quint32 n = 0;
+    for (quint32 i = 0; i < orderSize; ++i) {
+        Slot &slot = slots[at(i)];
+        if (slot.live && predicate(slot)) {
+            kill(slot);
+            ++n;
+        }
+    }
     if (n > 0) {
-        if (this->queue.isEmpty()) {
-            notEmpty.clear();
-        } else {
-            notEmpty.set();
+        compact();
+    }
+    return n;
+}
+
+template<typename T>
+template<typename Predicate>
+typename BlockingQueue<T>::Storage::Slot *BlockingQueue<T>::Storage::findIf(Predicate predicate)
+{
+    for (quint32 i = 0; i < orderSize; ++i) {
+        Slot &slot = slots[at(i)];
+        if (slot.live && predicate(slot)) {
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+template<typename T>
+void BlockingQueue<T>::Storage::clear()
+{
+    for (quint32 i = 0; i < orderSize; ++i) {
+        Slot &slot = slots[at(i)];
+        if (slot.live) {
+            kill(slot);
         }
-        if (static_cast<quint32>(queue.size()) >= mCapacity) {
-            notFull.clear();
+        freeSlots.push_back(at(i));
+    }
+    orderHead = 0;
+    orderSize = 0;
+    liveCount = 0;
+    deadCount = 0;
+}
+
+template<typename T>
+quint32 BlockingQueue<T>::Storage::allocate()
+{
+    if (freeSlots.empty()) {
+        slots.emplace_back();
+        return static_cast<quint32>(slots.size() - 1);
+    }
+    const quint32 index = freeSlots.back();
+    freeSlots.pop_back();
+    return index;
+}
+
+template<typename T>
+void BlockingQueue<T>::Storage::kill(Slot &slot)
+{
+    slot.e = T();  // release what the element holds now, not when the slot is reused.
+    slot.live = false;
+    if (++slot.generation == 0) {
+        slot.generation = 1;
+    }
+    --liveCount;
+    ++deadCount;
+}
+
+template<typename T>
+void BlockingQueue<T>::Storage::grow()
+{
+    std::vector<quint32> bigger((orderMask + 1) * 2);
+    for (quint32 i = 0; i < orderSize; ++i) {
+        bigger[i] = at(i);
+    }
+    order.swap(bigger);
+    orderHead = 0;
+    orderMask = static_cast<quint32>(order.size() - 1);
+}
+
+template<typename T>
+void BlockingQueue<T>::Storage::compact()
+{
+    quint32 n = 0;
+    for (quint32 i = 0; i < orderSize; ++i) {
+        const quint32 index = at(i);
+        if (slots[index].live) {
+            at(n++) = index;
         } else {
-            notFull.set();
+            freeSlots.push_back(index);
         }
-        lock.unlock();
-        return true;
+    }
+    orderSize = n;
+    deadCount = 0;
+}
+
+template<typename T>
+void BlockingQueue<T>::Storage::trim()
+{
+    while (orderSize > 0 && !slots[at(0)].live) {
+        freeSlots.push_back(at(0));
+        orderHead = (orderHead + 1) & orderMask;
+        --orderSize;
+        --deadCount;
+    }
+    while (orderSize > 0 && !slots[at(orderSize - 1)].live) {
+        freeSlots.push_back(at(orderSize - 1));
+        --orderSize;
+        --deadCount;
+    }
+}
+
+template<typename T>
+void BlockingQueue<T>::setCapacity(quint32 capacity)
+{
+    if (mMode == SingleProducerSingleConsumer) {
+        // can not exceed the preallocated ring.
+        mCapacity.storeRelease(qMin(capacity, ringMask + 1));
+        ringWakePutter();
+        return;
+    }
+    lock(&mutex);
+    mCapacity.storeRelease(capacity);
+    admitPutters();
+    updateCount();
+    mutex.unlock();
+    notifyWatchers(false, true);
+}
+
+template<typename T>
+void BlockingQueue<T>::setRelaxedSize(bool relaxed)
+{
+    relaxedSize.storeRelease(relaxed);
+}
+
+template<typename T>
+void BlockingQueue<T>::setOverflowPolicy(OverflowPolicy policy)
+{
+    if (mMode == SingleProducerSingleConsumer) {
+        // a putting thread that has seen the old policy has finished with the head once we have the lock.
+        lock(&headMutex);
+        overflow.storeRelease(policy);
+        headMutex.unlock();
+        return;
+    }
+    // putters already waiting in line keep waiting, the policy applies to the next put() that finds the queue full.
+    overflow.storeRelease(policy);
+}
+
+template<typename T>
+void BlockingQueue<T>::setStatisticsEnabled(bool enabled)
+{
+    statisticsEnabled.storeRelease(enabled);
+}
+
+template<typename T>
+BlockingQueueStatistics BlockingQueue<T>::statistics(bool reset)
+{
+    BlockingQueueStatistics s;
+    if (reset) {
+        s.enqueued = enqueued.fetchAndStoreOrdered(0);
+        s.dequeued = dequeued.fetchAndStoreOrdered(0);
+        s.putWaits = putWaits.fetchAndStoreOrdered(0);
+        s.putWaitNsecs = putWaitNsecs.fetchAndStoreOrdered(0);
+        s.getWaits = getWaits.fetchAndStoreOrdered(0);
+        s.getWaitNsecs = getWaitNsecs.fetchAndStoreOrdered(0);
+        s.putTimeouts = putTimeouts.fetchAndStoreOrdered(0);
+        s.getTimeouts = getTimeouts.fetchAndStoreOrdered(0);
+        s.contentions = contentions.fetchAndStoreOrdered(0);
+        // the next peak can not be lower than what is queued now.
+        s.peakSize = peakSize.fetchAndStoreOrdered(approximateSize());
     } else {
-        lock.unlock();
-        return false;
+        s.enqueued = enqueued.loadAcquire();
+        s.dequeued = dequeued.loadAcquire();
+        s.putWaits = putWaits.loadAcquire();
+        s.putWaitNsecs = putWaitNsecs.loadAcquire();
+        s.getWaits = getWaits.loadAcquire();
+        s.getWaitNsecs = getWaitNsecs.loadAcquire();
+        s.putTimeouts = putTimeouts.loadAcquire();
+        s.getTimeouts = getTimeouts.loadAcquire();
+        s.contentions = contentions.loadAcquire();
+        s.peakSize = peakSize.loadAcquire();
     }
+    return s;
 }
 
 template<typename T>
-bool BlockingQueue<T>::put(const T &e)
+void BlockingQueue<T>::recordSize(quint32 size)
 {
-    if (!notFull.wait()) {
-        return false;
+    quint32 peak = peakSize.loadAcquire();
+    while (size > peak && !peakSize.testAndSetOrdered(peak, size, peak)) {
     }
-    return putForcedly(e);
 }
 
 template<typename T>
-bool BlockingQueue<T>::putForcedly(const T &e)
+void BlockingQueue<T>::clear()
 {
-    lock.lockForWrite();
-    queue.enqueue(e);
-    notEmpty.set();
-    if (static_cast<quint32>(queue.size()) >= mCapacity) {
-        notFull.clear();
+    if (mMode == SingleProducerSingleConsumer) {
+        ringClear();
+        return;
     }
-    lock.unlock();
-    return true;
+    lock(&mutex);
+    queue.clear();
+    admitPutters();
+    updateCount();
+    mutex.unlock();
 }
 
 template<typename T>
-bool BlockingQueue<T>::returns(const T &e)
+void BlockingQueue<T>::close()
 {
-    if (!notFull.wait()) {
-        return false;
+    if (closed.fetchAndStoreOrdered(true)) {
+        return;
+    }
+    notifyWatchers(true, true);
+    if (mMode == SingleProducerSingleConsumer) {
+        // the sleeping side looks at the flag again with parkingMutex held, so it can not miss this.
+        lock(&parkingMutex);
+        ringNotEmpty.wakeAll();
+        ringNotFull.wakeAll();
+        parkingMutex.unlock();
+        return;
     }
-    return returnsForcely(e);
+    lock(&mutex);
+    // waiters that are not done when they wake up return false.
+    while (!getters.isEmpty()) {
+        getters.takeFirst()->condition.wakeOne();
+    }
+    while (!putters.isEmpty()) {
+        putters.takeFirst()->condition.wakeOne();
+    }
+    mutex.unlock();
 }
 
 template<typename T>
-bool BlockingQueue<T>::returnsForcely(const T &e)
+void BlockingQueue<T>::addReadableWatcher(const Event &event)
+{
+    watcherMutex.lock();
+    readableWatchers.append(event);
+    watcherCount.fetchAndAddOrdered(1);
+    watcherMutex.unlock();
+}
+
+template<typename T>
+void BlockingQueue<T>::addWritableWatcher(const Event &event)
+{
+    watcherMutex.lock();
+    writableWatchers.append(event);
+    watcherCount.fetchAndAddOrdered(1);
+    watcherMutex.unlock();
+}
+
+template<typename T>
+void BlockingQueue<T>::removeWatcher(const Event &event)
+{
+    watcherMutex.lock();
+    const int n = readableWatchers.removeAll(event) + writableWatchers.removeAll(event);
+    watcherCount.fetchAndSubOrdered(static_cast<quint32>(n));
+    watcherMutex.unlock();
+}
+
+template<typename T>
+void BlockingQueue<T>::setNotifier(QObject *receiver, const char *member, quint32 watermark)
+{
+    watcherMutex.lock();
+    notifyReceiver = receiver;
+    notifyMember = member;
+    notifyWatermark.storeRelease(qMax(watermark, 1u));
+    notifyPending.storeRelease(false);
+    notifying.storeRelease(receiver != nullptr);
+    watcherMutex.unlock();
+    // the queue may be above the watermark already.
+    notifyWatchers(true, false);
+}
+
+template<typename T>
+void BlockingQueue<T>::setWatchers(bool readable, bool writable)
 {
-    lock.lockForWrite();
-    queue.prepend(e);
-    notEmpty.set();
-    if (static_cast<quint32>(queue.size()) >= mCapacity) {
-        notFull.clear();
+    watcherMutex.lock();
+    bool recheck = readable;
+    if (writable) {
+        for (Event &event : writableWatchers) {
+            event.set();
+        }
+        if (notifyPending.loadAcquire() && approximateSize() < notifyWatermark.loadAcquire()) {
+            // look again after clearing, a putter may have seen it still set.
+            notifyPending.fetchAndStoreOrdered(false);
+            recheck = true;
+        }
     }
-    lock.unlock();
-    return true;
+    if (readable) {
+        for (Event &event : readableWatchers) {
+            event.set();
+        }
+    }
+    if (recheck && !notifyReceiver.isNull() && approximateSize() >= notifyWatermark.loadAcquire()
+        && !notifyPending.fetchAndStoreOrdered(true)) {
+        QMetaObject::invokeMethod(notifyReceiver.data(), notifyMember.constData(), Qt::QueuedConnection);
+    }
+    watcherMutex.unlock();
 }
 
 template<typename T>
-T BlockingQueue<T>::get()
+bool BlockingQueue<T>::remove(const T &e)
 {
-    if (!notEmpty.wait())
-        return T();
-    lock.lockForWrite();
-    const T &e = queue.dequeue();
-    if (this->queue.isEmpty()) {
-        notEmpty.clear();
+    if (mMode == SingleProducerSingleConsumer) {
+        return ringRemove(e);
     }
-    if (static_cast<quint32>(queue.size()) < mCapacity) {
-        notFull.set();
+    lock(&mutex);
+    const bool removed = queue.removeIf([&e](const typename Storage::Slot &slot) { return slot.e == e; }) > 0;
+    if (removed) {
+        admitPutters();
+        updateCount();
     }
-    lock.unlock();
-    return e;
+    mutex.unlock();
+    return removed;
 }
 
 template<typename T>
-T BlockingQueue<T>::peek()
+bool BlockingQueue<T>::insert(T &e, bool atHead, bool forcedly, int priority, const QDeadlineTimer &deadline,
+                              qint64 key, Handle *handle)
 {
-    lock.lockForRead();
-    if (this->queue.isEmpty()) {
-        lock.unlock();
-        return T();
+    if (closed.loadAcquire()) {
+        return false;
     }
-    const T &t = queue.head();
-    lock.unlock();
-    return t;
+    if (!getters.isEmpty()) {
+        Getter *getter = getters.takeFirst();
+        getter->e = std::move(e);
+        getter->done = true;
+        getter->condition.wakeOne();
+        recordPut(1);
+        return true;
+    }
+    // do not pass the putters in line, unless forced to.
+    if (forcedly || (putters.isEmpty() && queue.size() < mCapacity.loadAcquire())) {
+        setHandle(handle, push(atHead, priority, key, std::move(e)));
+        recordPut(1);
+        return true;
+    }
+    const int policy = atHead ? static_cast<int>(Block) : overflow.loadAcquire();
+    if (policy == DropNewest || (queue.isEmpty() && policy != Block)) {
+        droppedCount.fetchAndAddRelaxed(1);
+        return false;
+    } else if (policy == DropOldest || policy == ReplaceTail) {
+        if (policy == DropOldest) {
+            queue.removeFirst();
+        } else {
+            queue.removeLast();
+        }
+        droppedCount.fetchAndAddRelaxed(1);
+        setHandle(handle, push(false, priority, key, std::move(e)));
+        recordPut(1);
+        return true;
+    }
+    if (deadline.hasExpired()) {
+        recordTimeout(&putTimeouts);
+        return false;
+    }
+    Putter putter(&e, atHead, priority, key, handle);
+    putters.append(&putter);
+    updateCount();  // putMany() may have inserted some before.
+    const qint64 since = waitStarted();
+    while (!putter.done && !closed.loadAcquire()) {
+        if (!putter.condition.wait(&mutex, waitTime(deadline)) && !putter.done && deadline.hasExpired()) {
+            putters.removeOne(&putter);
+            waitFinished(since, &putWaits, &putWaitNsecs);
+            recordTimeout(&putTimeouts);
+            return false;
+        }
+    }
+    waitFinished(since, &putWaits, &putWaitNsecs);
+    if (!putter.done) {
+        return false;  // close() has taken us out of line.
+    }
+    recordPut(1);
+    return true;
 }
 
 template<typename T>
-inline bool BlockingQueue<T>::isEmpty()
+void BlockingQueue<T>::admitPutters()
 {
-    lock.lockForRead();
-    bool t = queue.isEmpty();
-    lock.unlock();
-    return t;
+    // the queue is not empty once a putter is admitted, so there is no getter to hand to.
+    while (!putters.isEmpty() && queue.size() < mCapacity.loadAcquire()) {
+        Putter *putter = putters.takeFirst();
+        // another putter may have queued the same key while this one was waiting.
+        if (putter->key < 0 || !replace(*putter->e, putter->key)) {
+            setHandle(putter->handle, push(putter->atHead, putter->priority, putter->key, std::move(*putter->e)));
+        }
+        putter->done = true;
+        putter->condition.wakeOne();
+    }
 }
 
 template<typename T>
-inline bool BlockingQueue<T>::isFull()
+template<typename... Args>
+quint32 BlockingQueue<T>::push(bool atHead, int priority, qint64 key, Args &&...args)
 {
-    lock.lockForRead();
-    bool t = static_cast<quint32>(queue.size()) >= mCapacity;
-    lock.unlock();
-    return t;
+    return queue.insert(atHead, priority, key, std::forward<Args>(args)...);
 }
 
 template<typename T>
-inline quint32 BlockingQueue<T>::capacity() const
+bool BlockingQueue<T>::replace(T &e, qint64 key)
 {
-    const_cast<BlockingQueue<T> *>(this)->lock.lockForRead();
-    quint32 c = mCapacity;
-    const_cast<BlockingQueue<T> *>(this)->lock.unlock();
-    return c;
+    // at most one element per key is queued, a linear scan is fine for short command queues.
+    typename Storage::Slot *slot = queue.findIf([key](const typename Storage::Slot &slot) { return slot.key == key; });
+    if (!slot) {
+        return false;
+    }
+    slot->e = std::move(e);
+    return true;
 }
 
 template<typename T>
-inline quint32 BlockingQueue<T>::size() const
+T BlockingQueue<T>::pop()
 {
-    const_cast<BlockingQueue<T> *>(this)->lock.lockForRead();
-    int s = queue.size();
-    const_cast<BlockingQueue<T> *>(this)->lock.unlock();
-    return s;
+    return queue.takeFirst();
 }
 
 template<typename T>
-inline quint32 BlockingQueue<T>::getting() const
+bool BlockingQueue<T>::put(const T &e)
 {
-    const_cast<BlockingQueue<T> *>(this)->lock.lockForRead();
-    int g = notEmpty.getting();
-    const_cast<BlockingQueue<T> *>(this)->lock.unlock();
-    return g;
+    return put(T(e));
 }
 
 template<typename T>
-inline bool BlockingQueue<T>::contains(const T &e)
+bool BlockingQueue<T>::putForcedly(const T &e)
 {
-    const_cast<BlockingQueue<T> *>(this)->lock.lockForRead();
-    bool t = queue.contains(e);
-    const_cast<BlockingQueue<T> *>(this)->lock.unlock();
-    return t;
+    return putForcedly(T(e));
+}
+
+template<typename T>
+bool BlockingQueue<T>::returns(const T &e)
+{
+    return returns(T(e));
+}
+
+template<typename T>
+bool BlockingQueue<T>::returnsForcely(const T &e)
+{
+    return returnsForcely(T(e));
+}
+
+template<typename T>
+bool BlockingQueue<T>::put(T &&e)
+{
+    if (mMode == SingleProducerSingleConsumer) {
+        return ringPut(e, false);
+    }
+    lock(&mutex);
+    bool ok = insert(e, false, false);
+    updateCount();
+    mutex.unlock();
+    return ok;
+}
+
+template<typename T>
+bool BlockingQueue<T>::putForcedly(T &&e)
+{
+    if (mMode == SingleProducerSingleConsumer) {
+        return ringPut(e, true);
+    }
+    lock(&mutex);
+    bool ok = insert(e, false, true);
+    updateCount();
+    mutex.unlock();
+    return ok;
+}
+
+template<typename T>
+bool BlockingQueue<T>::returns(T &&e)
+{
+    if (mMode == SingleProducerSingleConsumer) {
+        return ringReturns(e);
+    }
+    lock(&mutex);
+    bool ok = insert(e, true, false);
+    updateCount();
+    mutex.unlock();
+    return ok;
+}
+
+template<typename T>
+bool BlockingQueue<T>::returnsForcely(T &&e)
+{
+    if (mMode == SingleProducerSingleConsumer) {
+        return ringReturns(e);
+    }
+    lock(&mutex);
+    bool ok = insert(e, true, true);
+    updateCount();
+    mutex.unlock();
+    return ok;
+}
+
+template<typename T>
+bool BlockingQueue<T>::put(const T &e, int priority)
+{
+    return put(T(e), priority);
+}
+
+template<typename T>
+bool BlockingQueue<T>::put(T &&e, int priority)
+{
+    if (mMode == SingleProducerSingleConsumer) {
+        return ringPut(e, false);
+    }
+    lock(&mutex);
+    bool ok = insert(e, false, false, priority);
+    updateCount();
+    mutex.unlock();
+    return ok;
+}
+
+template<typename T>
+bool BlockingQueue<T>::putCoalesced(const T &e, qint64 key, int priority)
+{
+    return putCoalesced(T(e), key, priority);
+}
+
+template<typename T>
+bool BlockingQueue<T>::putCoalesced(T &&e, qint64 key, int priority)
+{
+    Q_ASSERT(key >= 0);
+    if (mMode == SingleProducerSingleConsumer) {
+        return ringPut(e, false);
+    }
+    lock(&mutex);
+    bool ok;
+    if (closed.loadAcquire()) {
+        ok = false;
+    } else if (replace(e, key)) {
+        recordPut(1);
+        ok = true;
+    } else {
+        ok = insert(e, false, false, priority, QDeadlineTimer::Forever, key);
+    }
+    updateCount();
+    mutex.unlock();
+    return ok;
+}
+
+template<typename T>
+bool BlockingQueue<T>::putWithHandle(const T &e, Handle *handle, int priority)
+{
+    return putWithHandle(T(e), handle, priority);
+}
+
+template<typename T>
+bool BlockingQueue<T>::putWithHandle(T &&e, Handle *handle, int priority)
+{
+    *handle = Handle();
+    if (mMode == SingleProducerSingleConsumer) {
+        return ringPut(e, false);
+    }
+    lock(&mutex);
+    bool ok = insert(e, false, false, priority, QDeadlineTimer::Forever, -1, handle);
+    updateCount();
+    mutex.unlock();
+    return ok;
+}
+
+template<typename T>
+bool BlockingQueue<T>::cancel(const Handle &handle)
+{
+    if (mMode == SingleProducerSingleConsumer || !handle.isValid()) {
+        return false;
+    }
+    lock(&mutex);
+    const bool cancelled = queue.cancel(handle.index, handle.generation);
+    if (cancelled) {
+        admitPutters();
+        updateCount();
+    }
+    mutex.unlock();
+    return cancelled;
+}
+
+template<typename T>
+template<typename... Args>
+bool BlockingQueue<T>::emplace(Args &&...args)
+{
+    if (mMode != SingleProducerSingleConsumer) {
+        lock(&mutex);
+        if (!closed.loadAcquire() && getters.isEmpty() && putters.isEmpty()
+            && queue.size() < mCapacity.loadAcquire()) {
+            push(false, 0, -1, std::forward<Args>(args)...);
+            recordPut(1);
+            updateCount();
+            mutex.unlock();
+            return true;
+        }
+        mutex.unlock();
+    }
+    return put(T(std::forward<Args>(args)...));
+}
+
+template<typename T>
+T BlockingQueue<T>::take()
+{
+    T e = T();
+    getUntil(&e, QDeadlineTimer::Forever);
+    return e;
+}
+
+template<typename T>
+bool BlockingQueue<T>::tryPut(const T &e)
+{
+    return tryPut(T(e));
+}
+
+template<typename T>
+bool BlockingQueue<T>::tryPut(T &&e)
+{
+    return putUntil(std::move(e), QDeadlineTimer(0));
+}
+
+template<typename T>
+bool BlockingQueue<T>::putUntil(const T &e, const QDeadlineTimer &deadline)
+{
+    return putUntil(T(e), deadline);
+}
+
+template<typename T>
+bool BlockingQueue<T>::putUntil(T &&e, const QDeadlineTimer &deadline)
+{
+    if (mMode == SingleProducerSingleConsumer) {
+        return ringPut(e, false, deadline);
+    }
+    lock(&mutex);
+    bool ok = insert(e, false, false, 0, deadline);
+    updateCount();
+    mutex.unlock();
+    return ok;
+}
+
+template<typename T>
+bool BlockingQueue<T>::tryGet(T *out)
+{
+    return getUntil(out, QDeadlineTimer(0));
+}
+
+template<typename T>
+bool BlockingQueue<T>::getFor(T *out, qint64 msecs)
+{
+    return getUntil(out, QDeadlineTimer(msecs));
+}
+
+template<typename T>
+bool BlockingQueue<T>::getUntil(T *out, const QDeadlineTimer &deadline)
+{
+    if (mMode == SingleProducerSingleConsumer) {
+        return ringGet(out, deadline);
+    }
+    lock(&mutex);
+    if (!queue.isEmpty()) {
+        *out = pop();
+        admitPutters();
+        updateCount();
+        mutex.unlock();
+        recordGet(1);
+        return true;
+    }
+    if (closed.loadAcquire()) {
+        mutex.unlock();
+        return false;
+    }
+    if (deadline.hasExpired()) {
+        mutex.unlock();
+        recordTimeout(&getTimeouts);
+        return false;
+    }
+    Getter getter;
+    getters.append(&getter);
+    const qint64 since = waitStarted();
+    while (!getter.done && !closed.loadAcquire()) {
+        if (!getter.condition.wait(&mutex, waitTime(deadline)) && !getter.done && deadline.hasExpired()) {
+            getters.removeOne(&getter);
+            mutex.unlock();
+            waitFinished(since, &getWaits, &getWaitNsecs);
+            recordTimeout(&getTimeouts);
+            return false;
+        }
+    }
+    mutex.unlock();
+    waitFinished(since, &getWaits, &getWaitNsecs);
+    if (!getter.done) {
+        return false;
+    }
+    recordGet(1);
+    *out = std::move(getter.e);
+    return true;
+}
+
+template<typename T>
+T BlockingQueue<T>::peek()
+{
+    if (mMode == SingleProducerSingleConsumer) {
+        return ringPeek();
+    }
+    lock(&mutex);
+    if (queue.isEmpty()) {
+        mutex.unlock();
+        return T();
+    }
+    T t = queue.first().e;
+    mutex.unlock();
+    return t;
+}
+
+template<typename T>
+inline bool BlockingQueue<T>::isEmpty()
+{
+    return size() == 0;
+}
+
+template<typename T>
+inline bool BlockingQueue<T>::isFull()
+{
+    if (mMode == SingleProducerSingleConsumer) {
+        quint32 h = head.loadAcquire();
+        return tail.loadAcquire() - h >= mCapacity.loadAcquire();
+    }
+    return size() >= mCapacity.loadAcquire();
+}
+
+template<typename T>
+inline quint32 BlockingQueue<T>::capacity() const
+{
+    return mCapacity.loadAcquire();
+}
+
+template<typename T>
+inline quint32 BlockingQueue<T>::size() const
+{
+    if (mMode == SingleProducerSingleConsumer) {
+        // load head before tail, or the getting thread may pass the tail we have seen.
+        quint32 h = head.loadAcquire();
+        return tail.loadAcquire() - h + returnedCount.loadAcquire();
+    }
+    if (relaxedSize.loadAcquire()) {
+        return count.loadAcquire();
+    }
+    BlockingQueue<T> *self = const_cast<BlockingQueue<T> *>(this);
+    self->lock(&self->mutex);
+    quint32 s = queue.size();
+    self->mutex.unlock();
+    return s;
+}
+
+template<typename T>
+inline quint32 BlockingQueue<T>::getting() const
+{
+    if (mMode == SingleProducerSingleConsumer) {
+        return ringGetting.loadAcquire() ? 1 : 0;
+    }
+    BlockingQueue<T> *self = const_cast<BlockingQueue<T> *>(this);
+    self->lock(&self->mutex);
+    quint32 g = static_cast<quint32>(getters.size());
+    self->mutex.unlock();
+    return g;
+}
+
+template<typename T>
+inline bool BlockingQueue<T>::contains(const T &e)
+{
+    if (mMode == SingleProducerSingleConsumer) {
+        return ringContains(e);
+    }
+    lock(&mutex);
+    bool t = queue.findIf([&e](const typename Storage::Slot &slot) { return slot.e == e; }) != nullptr;
+    mutex.unlock();
+    return t;
+}
+
+template<typename T>
+template<typename Container>
+quint32 BlockingQueue<T>::putMany(const Container &elements)
+{
+    quint32 n = 0;
+    if (mMode == SingleProducerSingleConsumer) {
+        if (closed.loadAcquire()) {
+            return n;
+        }
+        if (overflow.loadAcquire() != Block) {
+            for (const T &e : elements) {
+                T copy(e);
+                if (ringPut(copy, false)) {
+                    ++n;
+                } else if (closed.loadAcquire()) {
+                    break;
+                }
+            }
+            return n;
+        }
+        const quint32 published = tail.loadAcquire();
+        quint32 t = published;
+        for (const T &e : elements) {
+            quint32 used = t - head.loadAcquire();
+            if (used > ringMask || used >= mCapacity.loadAcquire()) {
+                // let the getting thread have what is written so far before sleeping.
+                tail.fetchAndStoreOrdered(t);
+                ringWakeGetter();
+                if (!ringWaitForSpace(t, false)) {
+                    break;
+                }
+            }
+            ring[t & ringMask] = e;
+            ++t;
+            ++n;
+        }
+        if (t != published) {
+            tail.fetchAndStoreOrdered(t);
+            ringWakeGetter();
+        }
+        recordPut(n);
+        return n;
+    }
+    lock(&mutex);
+    for (const T &e : elements) {
+        T copy(e);
+        if (insert(copy, false, false)) {
+            ++n;
+        } else if (closed.loadAcquire()) {
+            break;
+        }
+    }
+    updateCount();
+    mutex.unlock();
+    return n;
+}
+
+template<typename T>
+template<typename Container>
+quint32 BlockingQueue<T>::getUpTo(quint32 n, Container *out)
+{
+    quint32 got = 0;
+    if (n == 0) {
+        return got;
+    }
+    if (mMode == SingleProducerSingleConsumer) {
+        for (; got < n && !returned.empty(); ++got) {
+            out->push_back(std::move(returned.front()));
+            returned.pop_front();
+            returnedCount.fetchAndSubOrdered(1);
+        }
+        if (got == 0) {
+            ringWaitForElement(head.loadAcquire());
+        }
+        const bool headLocked = lockRingHead();
+        quint32 h = head.loadAcquire();
+        const quint32 t = tail.loadAcquire();
+        const quint32 from = h;
+        for (; got < n && h != t; ++h, ++got) {
+            T &slot = ring[h & ringMask];
+            out->push_back(std::move(slot));
+            slot = T();
+        }
+        if (h != from) {
+            head.fetchAndStoreOrdered(h);
+        }
+        if (headLocked) {
+            headMutex.unlock();
+        }
+        if (h != from) {
+            ringWakePutter();
+        }
+        recordGet(got);
+        return got;
+    }
+    lock(&mutex);
+    if (queue.isEmpty()) {
+        if (closed.loadAcquire()) {
+            mutex.unlock();
+            return got;
+        }
+        Getter getter;
+        getters.append(&getter);
+        const qint64 since = waitStarted();
+        while (!getter.done && !closed.loadAcquire()) {
+            getter.condition.wait(&mutex);
+        }
+        waitFinished(since, &getWaits, &getWaitNsecs);
+        if (!getter.done) {
+            mutex.unlock();
+            return got;
+        }
+        out->push_back(std::move(getter.e));
+        ++got;
+    }
+    for (; got < n && !queue.isEmpty(); ++got) {
+        out->push_back(pop());
+    }
+    admitPutters();
+    updateCount();
+    mutex.unlock();
+    recordGet(got);
+    return got;
+}
+
+template<typename T>
+template<typename Container>
+quint32 BlockingQueue<T>::drainTo(Container *out)
+{
+    quint32 got = 0;
+    if (mMode == SingleProducerSingleConsumer) {
+        for (; !returned.empty(); ++got) {
+            out->push_back(std::move(returned.front()));
+            returned.pop_front();
+            returnedCount.fetchAndSubOrdered(1);
+        }
+        const bool headLocked = lockRingHead();
+        quint32 h = head.loadAcquire();
+        const quint32 t = tail.loadAcquire();
+        const quint32 from = h;
+        for (; h != t; ++h, ++got) {
+            T &slot = ring[h & ringMask];
+            out->push_back(std::move(slot));
+            slot = T();
+        }
+        if (h != from) {
+            head.fetchAndStoreOrdered(h);
+        }
+        if (headLocked) {
+            headMutex.unlock();
+        }
+        if (h != from) {
+            ringWakePutter();
+        }
+        recordGet(got);
+        return got;
+    }
+    lock(&mutex);
+    for (; !queue.isEmpty(); ++got) {
+        out->push_back(pop());
+    }
+    admitPutters();
+    updateCount();
+    mutex.unlock();
+    recordGet(got);
+    return got;
+}
+
+template<typename T>
+template<typename Predicate>
+quint32 BlockingQueue<T>::discardWhile(Predicate predicate, T *lastDiscarded)
+{
+    quint32 n = 0;
+    if (mMode == SingleProducerSingleConsumer) {
+        for (; !returned.empty() && predicate(returned.front()); ++n) {
+            if (lastDiscarded) {
+                *lastDiscarded = std::move(returned.front());
+            }
+            returned.pop_front();
+            returnedCount.fetchAndSubOrdered(1);
+        }
+        if (!returned.empty()) {
+            recordGet(n);
+            return n;
+        }
+        const bool headLocked = lockRingHead();
+        quint32 h = head.loadAcquire();
+        const quint32 t = tail.loadAcquire();
+        const quint32 from = h;
+        for (; h != t && predicate(ring[h & ringMask]); ++h, ++n) {
+            T &slot = ring[h & ringMask];
+            if (lastDiscarded) {
+                *lastDiscarded = std::move(slot);
+            }
+            slot = T();
+        }
+        if (h != from) {
+            head.fetchAndStoreOrdered(h);
+        }
+        if (headLocked) {
+            headMutex.unlock();
+        }
+        if (h != from) {
+            ringWakePutter();
+        }
+        recordGet(n);
+        return n;
+    }
+    lock(&mutex);
+    for (; !queue.isEmpty() && predicate(queue.first().e); ++n) {
+        if (lastDiscarded) {
+            *lastDiscarded = pop();
+        } else {
+            queue.removeFirst();
+        }
+    }
+    if (n > 0) {
+        admitPutters();
+        updateCount();
+    }
+    mutex.unlock();
+    recordGet(n);
+    return n;
+}
+
+template<typename T>
+bool BlockingQueue<T>::ringPut(T &e, bool forcedly, const QDeadlineTimer &deadline)
+{
+    const quint32 t = tail.loadAcquire();
+    if (!forcedly && overflow.loadAcquire() != Block && !closed.loadAcquire()) {
+        const quint32 used = t - head.loadAcquire();
+        bool accepted;
+        if ((used > ringMask || used >= mCapacity.loadAcquire()) && ringOverflow(e, t, &accepted)) {
+            return accepted;
+        }
+    }
+    if (!ringWaitForSpace(t, forcedly, deadline)) {
+        return false;
+    }
+    ring[t & ringMask] = std::move(e);
+    tail.fetchAndStoreOrdered(t + 1);
+    ringWakeGetter();
+    recordPut(1);
+    return true;
+}
+
+template<typename T>
+bool BlockingQueue<T>::ringOverflow(T &e, quint32 t, bool *accepted)
+{
+    const int policy = overflow.loadAcquire();
+    if (policy == DropNewest) {
+        droppedCount.fetchAndAddRelaxed(1);
+        *accepted = false;
+        return true;
+    }
+    lock(&headMutex);
+    // the policy may have changed back to Block, or the getting thread may have made room, before we got the lock.
+    quint32 h = head.loadAcquire();
+    const quint32 capacity = qMin(mCapacity.loadAcquire(), ringMask + 1);
+    if (overflow.loadAcquire() != policy || t - h < capacity || t == h) {
+        headMutex.unlock();
+        return false;
+    }
+    if (policy == ReplaceTail) {
+        ring[(t - 1) & ringMask] = std::move(e);
+        droppedCount.fetchAndAddRelaxed(1);
+        headMutex.unlock();
+        recordPut(1);
+        *accepted = true;
+        return true;
+    }
+    // DropOldest. the capacity may have been lowered, so there can be more than one to drop.
+    for (; t - h >= capacity && h != t; ++h) {
+        ring[h & ringMask] = T();
+        droppedCount.fetchAndAddRelaxed(1);
+    }
+    head.fetchAndStoreOrdered(h);
+    ring[t & ringMask] = std::move(e);
+    tail.fetchAndStoreOrdered(t + 1);
+    headMutex.unlock();
+    ringWakeGetter();
+    recordPut(1);
+    *accepted = true;
+    return true;
+}
+
+template<typename T>
+bool BlockingQueue<T>::ringWaitForSpace(quint32 t, bool forcedly, const QDeadlineTimer &deadline)
+{
+    qint64 since = -1;
+    while (true) {
+        if (closed.loadAcquire()) {
+            waitFinished(since, &putWaits, &putWaitNsecs);
+            return false;
+        }
+        quint32 used = t - head.loadAcquire();
+        if (used <= ringMask && (forcedly || used < mCapacity.loadAcquire())) {
+            waitFinished(since, &putWaits, &putWaitNsecs);
+            return true;
+        }
+        if (deadline.hasExpired()) {
+            waitFinished(since, &putWaits, &putWaitNsecs);
+            recordTimeout(&putTimeouts);
+            return false;
+        }
+        if (since < 0) {
+            since = waitStarted();
+        }
+        // full. announce that we are going to sleep, then look again before sleeping.
+        lock(&parkingMutex);
+        ringPutting.fetchAndStoreOrdered(true);
+        used = t - head.loadAcquire();
+        if (!closed.loadAcquire() && (used > ringMask || (!forcedly && used >= mCapacity.loadAcquire()))) {
+            ringNotFull.wait(&parkingMutex, waitTime(deadline));
+        }
+        ringPutting.storeRelease(false);
+        parkingMutex.unlock();
+    }
+}
+
+template<typename T>
+bool BlockingQueue<T>::ringWaitForElement(quint32 h, const QDeadlineTimer &deadline)
+{
+    qint64 since = -1;
+    while (tail.loadAcquire() == h) {
+        if (closed.loadAcquire()) {
+            waitFinished(since, &getWaits, &getWaitNsecs);
+            return false;
+        }
+        if (deadline.hasExpired()) {
+            waitFinished(since, &getWaits, &getWaitNsecs);
+            recordTimeout(&getTimeouts);
+            return false;
+        }
+        if (since < 0) {
+            since = waitStarted();
+        }
+        lock(&parkingMutex);
+        ringGetting.fetchAndStoreOrdered(true);
+        if (tail.loadAcquire() == h && !closed.loadAcquire()) {
+            ringNotEmpty.wait(&parkingMutex, waitTime(deadline));
+        }
+        ringGetting.storeRelease(false);
+        parkingMutex.unlock();
+    }
+    waitFinished(since, &getWaits, &getWaitNsecs);
+    return true;
+}
+
+template<typename T>
+bool BlockingQueue<T>::ringReturns(T &e)
+{
+    if (closed.loadAcquire()) {
+        return false;
+    }
+    // the ring slots before head may be refilled by the putting thread at any time, so keep them aside.
+    returned.push_front(std::move(e));
+    returnedCount.fetchAndAddOrdered(1);
+    recordPut(1);
+    return true;
+}
+
+template<typename T>
+bool BlockingQueue<T>::ringGet(T *out, const QDeadlineTimer &deadline)
+{
+    if (!returned.empty()) {
+        *out = std::move(returned.front());
+        returned.pop_front();
+        returnedCount.fetchAndSubOrdered(1);
+        recordGet(1);
+        return true;
+    }
+    if (!ringWaitForElement(head.loadAcquire(), deadline)) {
+        return false;
+    }
+    const bool headLocked = lockRingHead();
+    const quint32 h = head.loadAcquire();  // the putting thread may have dropped the one we waited for.
+    T &slot = ring[h & ringMask];
+    *out = std::move(slot);
+    slot = T();  // release what the element holds now, not when the slot is reused.
+    head.fetchAndStoreOrdered(h + 1);
+    if (headLocked) {
+        headMutex.unlock();
+    }
+    ringWakePutter();
+    recordGet(1);
+    return true;
+}
+
+template<typename T>
+T BlockingQueue<T>::ringPeek()
+{
+    if (!returned.empty()) {
+        return returned.front();
+    }
+    const bool headLocked = lockRingHead();
+    const quint32 h = head.loadAcquire();
+    const T e = tail.loadAcquire() == h ? T() : ring[h & ringMask];
+    if (headLocked) {
+        headMutex.unlock();
+    }
+    return e;
+}
+
+template<typename T>
+void BlockingQueue<T>::ringClear()
+{
+    returnedCount.fetchAndSubOrdered(static_cast<quint32>(returned.size()));
+    returned.clear();
+    const bool headLocked = lockRingHead();
+    const quint32 t = tail.loadAcquire();
+    for (quint32 h = head.loadAcquire(); h != t; ++h) {
+        ring[h & ringMask] = T();
+    }
+    head.fetchAndStoreOrdered(t);
+    if (headLocked) {
+        headMutex.unlock();
+    }
+    ringWakePutter();
+}
+
+template<typename T>
+bool BlockingQueue<T>::ringRemove(const T &e)
+{
+    const size_t before = returned.size();
+    returned.erase(std::remove(returned.begin(), returned.end(), e), returned.end());
+    quint32 n = static_cast<quint32>(before - returned.size());
+    returnedCount.fetchAndSubOrdered(n);
+    // published slots between head and tail belong to us, so the survivors are compacted towards tail.
+    const bool headLocked = lockRingHead();
+    const quint32 h = head.loadAcquire();
+    quint32 to = tail.loadAcquire();
+    for (quint32 from = to; from != h;) {
+        --from;
+        if (ring[from & ringMask] == e) {
+            ++n;
+            continue;
+        }
+        --to;
+        if (to != from) {
+            ring[to & ringMask] = std::move(ring[from & ringMask]);
+        }
+    }
+    if (to != h) {
+        for (quint32 i = h; i != to; ++i) {
+            ring[i & ringMask] = T();
+        }
+        head.fetchAndStoreOrdered(to);
+    }
+    if (headLocked) {
+        headMutex.unlock();
+    }
+    if (to == h) {
+        return n > 0;
+    }
+    ringWakePutter();
+    return true;
+}
+
+template<typename T>
+bool BlockingQueue<T>::ringContains(const T &e)
+{
+    if (std::find(returned.begin(), returned.end(), e) != returned.end()) {
+        return true;
+    }
+    bool found = false;
+    const bool headLocked = lockRingHead();
+    const quint32 t = tail.loadAcquire();
+    for (quint32 h = head.loadAcquire(); h != t && !found; ++h) {
+        found = ring[h & ringMask] == e;
+    }
+    if (headLocked) {
+        headMutex.unlock();
+    }
+    return found;
+}
+
+template<typename T>
+void BlockingQueue<T>::ringWakeGetter()
+{
+    if (ringGetting.loadAcquire()) {
+        lock(&parkingMutex);
+        ringNotEmpty.wakeAll();
+        parkingMutex.unlock();
+    }
+    notifyWatchers(true, false);
+}
+
+template<typename T>
+void BlockingQueue<T>::ringWakePutter()
+{
+    if (ringPutting.loadAcquire()) {
+        lock(&parkingMutex);
+        ringNotFull.wakeAll();
+        parkingMutex.unlock();
+    }
+    notifyWatchers(false, true);
 }
 
 #endif  // BLOCKING_QUEUE_H
@@ -0,0 +1,36 @@
+#ifndef LAFPLAY_BLOCKING_QUEUE_STATISTICS_H
+#define LAFPLAY_BLOCKING_QUEUE_STATISTICS_H
+
+#include <QtCore/qglobal.h>
+
+// what a BlockingQueue did since statistics were enabled or last reset. times are in nanoseconds.
+struct BlockingQueueStatistics
+{
+    BlockingQueueStatistics()
+        : enqueued(0)
+        , dequeued(0)
+        , putWaits(0)
+        , putWaitNsecs(0)
+        , getWaits(0)
+        , getWaitNsecs(0)
+        , putTimeouts(0)
+        , getTimeouts(0)
+        , contentions(0)
+        , peakSize(0)
+    {
+    }
+    quint64 enqueued;  // elements accepted, including returned and coalesced ones.
+    quint64 dequeued;  // elements got, drained or discarded. clear() and remove() are not counted.
+    quint64 putWaits;  // number of times a putting thread slept because the queue was full.
+    quint64 putWaitNsecs;
+    quint64 getWaits;  // number of times a getting thread slept because the queue was empty.
+    quint64 getWaitNsecs;
+    // number of times a put or get gave up at its deadline. a tryGet() finding the queue empty counts, so a consumer
+    // polling with tryGet() sees starvation here instead of in getWaits.
+    quint64 putTimeouts;
+    quint64 getTimeouts;
+    quint64 contentions;  // number of times the lock was found held by another thread.
+    quint32 peakSize;
+};
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef LAFPLAY_CANCELLATION_TOKEN_H
+#define LAFPLAY_CANCELLATION_TOKEN_H
+
+#include <QtCore/qsharedpointer.h>
+#include <QtCore/qatomic.h>
+
+// a flag shared by every copy. a task that is cancelled before it starts is skipped, a running task may poll it.
+class CancellationToken
+{
+public:
+    CancellationToken()
+        : d(new QAtomicInteger<bool>(false))
+    {
+    }
+public:
+    inline void cancel() { d->storeRelease(true); }
+    inline bool isCancelled() const { return d->loadAcquire(); }
+    inline bool operator==(const CancellationToken &other) const { return d == other.d; }
+private:
+    QSharedPointer<QAtomicInteger<bool>> d;
+};
+
+#endif
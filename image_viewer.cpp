@@ -23,14 +23,13 @@ void ImageViewerPrivate::rebuildCached()
     }
 }
 
-class BuildCache : public QRunnable
+class BuildCache
 {
 public:
     BuildCache(QPointer<ImageViewerPrivate> p, Qt::TransformationMode tranMode, ImageViewer::Mode mode, double raite,
                const QImage &image, const QString &imagePath, const QSize &targetRect, const QPoint &targetPosition,
                double devicePixelRatioF);
-    virtual ~BuildCache() override;
-    virtual void run() override;
+    void run();
     inline QImage loadImage();
 public:
     QPointer<ImageViewerPrivate> p;
@@ -59,8 +58,6 @@ BuildCache::BuildCache(QPointer<ImageViewerPrivate> p, Qt::TransformationMode tr
 {
 }
 
-BuildCache::~BuildCache() { }
-
 void BuildCache::run()
 {
     if (p.isNull())
@@ -121,10 +118,8 @@ void ImageViewerPrivate::prepareBuildingCache()
         return;
     }
     building.storeRelease(true);
-    BuildCache *task = new BuildCache(this, transformationMode, mode, ratio, image, imagePath, q->size(), pos,
-                                      q->devicePixelRatioF());
-    task->setAutoDelete(true);
-    QThreadPool::globalInstance()->start(task);
+    BuildCache task(this, transformationMode, mode, ratio, image, imagePath, q->size(), pos, q->devicePixelRatioF());
+    WorkStealingPool::globalInstance()->submit([task]() mutable { task.run(); });
 }
 
 void ImageViewerPrivate::cacheBuilt(const QImage &result, const QSize &targetSize, const QPoint &, double targetRatio)
@@ -6,12 +6,12 @@
 #include <QtCore/qtimer.h>
 #include <QtCore/qdatetime.h>
 #include <QtCore/qpointer.h>
-#include <QtCore/qthreadpool.h>
 #include <QtGui/qpainter.h>
 #include <QtGui/qevent.h>
 #include <QtGui/qimagereader.h>
 #include <QtWidgets/qapplication.h>
 #include "image_viewer.h"
+#include "work_stealing_pool.h"
 
 class ImageViewerPrivate : public QObject
 {
@@ -15,6 +15,7 @@
 #include <QScreen>
 #include <QGraphicsSceneMouseEvent>
 #include "locust_table_widget.h"
+#include "work_stealing_pool.h"
 #include "QtWaitingSpinner/waitingspinnerwidget.h"
 
 #define ITEM_HEIGHT_NOEXPAND 126
@@ -1780,10 +1781,11 @@ QVector<int> _sort(int count, int sortColumn, Qt::SortOrder order, int sortRole,
                 listToCmp.append(data);
             }
 
-            ThreadPool pool(THREAD_COUNT);
-            pool.each<CmpData>([__cmp] (const CmpData &data) {
+            // 用全局的线程池，不再每次排序都创建线程。
+            WorkStealingPool::globalInstance()->parallelFor(listToCmp.size(), [&listToCmp, __cmp] (int i) {
+                const CmpData &data = listToCmp.at(i);
                 std::sort(data.listVisuals->begin() + data.begin, data.listVisuals->begin() + data.end, __cmp);
-            }, listToCmp);
+            });
 
             //simple merge->o(4n)
             QVector<int> ret(count);
@@ -0,0 +1,245 @@
+#include <QtCore/qthread.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qwaitcondition.h>
+#include <QtCore/qvector.h>
+#include <deque>
+#include "work_stealing_pool.h"
+
+namespace {
+
+enum { PriorityCount = 2 };
+
+class WorkerThread : public QThread
+{
+public:
+    WorkerThread(WorkStealingPoolPrivate *pool, int index)
+        : pool(pool)
+        , index(index)
+    {
+    }
+    virtual void run() override;
+public:
+    WorkStealingPoolPrivate * const pool;
+    const int index;
+    QMutex mutex;  // guards tasks. the owner pushes and pops the back, thieves take the front.
+    std::deque<std::function<void()>> tasks[PriorityCount];
+};
+
+thread_local WorkerThread *currentWorker = nullptr;
+
+}  // namespace
+
+class WorkStealingPoolPrivate
+{
+public:
+    WorkStealingPoolPrivate(int threadCount);
+    ~WorkStealingPoolPrivate();
+    WorkerThread *worker() const;  // the calling thread, or nullptr if it is not ours.
+    bool take(WorkerThread *self, std::function<void()> *task);
+    void work(WorkerThread *self);
+public:
+    QVector<WorkerThread *> workers;
+    QMutex idleMutex;
+    QWaitCondition idle;
+    QWaitCondition helped;  // pool threads in helpUntil() with nothing to run wait here, guarded by idleMutex.
+    QAtomicInteger<int> queued;  // tasks in all deques.
+    QAtomicInteger<int> sleeping;
+    QAtomicInteger<int> helping;
+    QAtomicInteger<quint32> nextWorker;  // round robin for tasks from outside of the pool.
+    QAtomicInteger<bool> exiting;
+};
+
+void WorkerThread::run()
+{
+    currentWorker = this;
+    pool->work(this);
+    currentWorker = nullptr;
+}
+
+WorkStealingPoolPrivate::WorkStealingPoolPrivate(int threadCount)
+    : queued(0)
+    , sleeping(0)
+    , helping(0)
+    , nextWorker(0)
+    , exiting(false)
+{
+    for (int i = 0; i < threadCount; ++i) {
+        workers.append(new WorkerThread(this, i));
+    }
+    for (WorkerThread *worker : workers) {
+        worker->start();
+    }
+}
+
+WorkStealingPoolPrivate::~WorkStealingPoolPrivate()
+{
+    idleMutex.lock();
+    exiting.storeRelease(true);
+    idle.wakeAll();
+    idleMutex.unlock();
+    for (WorkerThread *worker : workers) {
+        worker->wait();
+        delete worker;
+    }
+}
+
+WorkerThread *WorkStealingPoolPrivate::worker() const
+{
+    WorkerThread *w = currentWorker;
+    return w != nullptr && w->pool == this ? w : nullptr;
+}
+
+bool WorkStealingPoolPrivate::take(WorkerThread *self, std::function<void()> *task)
+{
+    if (queued.loadAcquire() <= 0) {
+        return false;
+    }
+    const int n = workers.size();
+    const int start = self ? self->index : 0;
+    for (int priority = 0; priority < PriorityCount; ++priority) {
+        // our own newest task first, its data is likely still in cache.
+        if (self) {
+            self->mutex.lock();
+            std::deque<std::function<void()>> &own = self->tasks[priority];
+            if (!own.empty()) {
+                *task = std::move(own.back());
+                own.pop_back();
+                self->mutex.unlock();
+                queued.fetchAndSubOrdered(1);
+                return true;
+            }
+            self->mutex.unlock();
+        }
+        for (int i = self ? 1 : 0; i < n; ++i) {
+            WorkerThread *victim = workers.at((start + i) % n);
+            victim->mutex.lock();
+            std::deque<std::function<void()>> &other = victim->tasks[priority];
+            if (!other.empty()) {
+                *task = std::move(other.front());
+                other.pop_front();
+                victim->mutex.unlock();
+                queued.fetchAndSubOrdered(1);
+                return true;
+            }
+            victim->mutex.unlock();
+        }
+    }
+    return false;
+}
+
+void WorkStealingPoolPrivate::work(WorkerThread *self)
+{
+    std::function<void()> task;
+    while (true) {
+        if (take(self, &task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        // count ourself as sleeping before looking at queued, and enqueue() adds to queued before looking at sleeping.
+        // one of us sees the other, so a task can not be left behind.
+        idleMutex.lock();
+        sleeping.fetchAndAddOrdered(1);
+        while (queued.loadAcquire() <= 0 && !exiting.loadAcquire()) {
+            idle.wait(&idleMutex);
+        }
+        sleeping.fetchAndSubOrdered(1);
+        const bool done = exiting.loadAcquire() && queued.loadAcquire() <= 0;
+        idleMutex.unlock();
+        if (done) {
+            return;
+        }
+    }
+}
+
+Q_GLOBAL_STATIC(WorkStealingPool, globalPool)
+
+WorkStealingPool::WorkStealingPool(int threadCount)
+    : d(new WorkStealingPoolPrivate(threadCount > 0 ? threadCount : qMax(1, QThread::idealThreadCount())))
+{
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    delete d;
+}
+
+WorkStealingPool *WorkStealingPool::globalInstance()
+{
+    return globalPool();
+}
+
+int WorkStealingPool::threadCount() const
+{
+    return d->workers.size();
+}
+
+void WorkStealingPool::enqueue(std::function<void()> &&task, Priority priority)
+{
+    WorkerThread *w = d->worker();
+    if (w == nullptr) {
+        w = d->workers.at(static_cast<int>(d->nextWorker.fetchAndAddRelaxed(1) % d->workers.size()));
+    }
+    w->mutex.lock();
+    w->tasks[priority].push_back(std::move(task));
+    w->mutex.unlock();
+    d->queued.fetchAndAddOrdered(1);
+    if (d->sleeping.loadAcquire() > 0 || d->helping.loadAcquire() > 0) {
+        d->idleMutex.lock();
+        d->idle.wakeOne();
+        // the new task may be the one a helper waits for, and no idle thread may be left to run it.
+        d->helped.wakeAll();
+        d->idleMutex.unlock();
+    }
+}
+
+bool WorkStealingPool::runPendingTask()
+{
+    WorkerThread *self = d->worker();
+    if (self == nullptr) {
+        return false;
+    }
+    std::function<void()> task;
+    if (!d->take(self, &task)) {
+        return false;
+    }
+    task();
+    return true;
+}
+
+bool WorkStealingPool::helpUntil(Event &done, const QDeadlineTimer &deadline)
+{
+    // a pool thread must not just sleep on done, the task it waits for may be queued behind it, or be submitted later
+    // while every pool thread is waiting here. so it sleeps on helped, which enqueue() and wakeHelpers() wake.
+    while (!done.isSet()) {
+        if (deadline.hasExpired()) {
+            return false;
+        }
+        if (runPendingTask()) {
+            continue;
+        }
+        if (d->worker() == nullptr) {
+            return done.wait(deadline);
+        }
+        // count ourself as helping before looking at queued and done, the other side changes them before looking at
+        // helping.
+        d->idleMutex.lock();
+        d->helping.fetchAndAddOrdered(1);
+        while (!done.isSet() && d->queued.loadAcquire() <= 0 && !deadline.hasExpired()) {
+            d->helped.wait(&d->idleMutex,
+                           deadline.isForever() ? ULONG_MAX : static_cast<unsigned long>(deadline.remainingTime()));
+        }
+        d->helping.fetchAndSubOrdered(1);
+        d->idleMutex.unlock();
+    }
+    return true;
+}
+
+void WorkStealingPool::wakeHelpers()
+{
+    if (d->helping.loadAcquire() > 0) {
+        d->idleMutex.lock();
+        d->helped.wakeAll();
+        d->idleMutex.unlock();
+    }
+}
@@ -0,0 +1,175 @@
+#ifndef LAFPLAY_WORK_STEALING_POOL_H
+#define LAFPLAY_WORK_STEALING_POOL_H
+
+#include <QtCore/qsharedpointer.h>
+#include <QtCore/qatomic.h>
+#include <QtCore/qdeadlinetimer.h>
+#include <functional>
+#include "blocking_queue.h"
+#include "cancellation_token.h"
+
+class WorkStealingPool;
+
+// shared by a submitted task and its futures.
+struct WorkStateBase
+{
+    WorkStateBase(WorkStealingPool *pool, const CancellationToken &token)
+        : pool(pool)
+        , token(token)
+        , skipped(false)
+    {
+    }
+    WorkStealingPool * const pool;
+    CancellationToken token;
+    Event done;
+    QAtomicInteger<bool> skipped;  // the token was cancelled before the task started.
+};
+
+template<typename T>
+struct WorkState : public WorkStateBase
+{
+    WorkState(WorkStealingPool *pool, const CancellationToken &token)
+        : WorkStateBase(pool, token)
+    {
+    }
+    template<typename F>
+    inline void run(F &f) { value = f(); }
+    T value;
+};
+
+template<>
+struct WorkState<void> : public WorkStateBase
+{
+    WorkState(WorkStealingPool *pool, const CancellationToken &token)
+        : WorkStateBase(pool, token)
+    {
+    }
+    template<typename F>
+    inline void run(F &f) { f(); }
+};
+
+template<typename T>
+class WorkFuture
+{
+public:
+    WorkFuture() { }  // names no task. wait() returns at once.
+    explicit WorkFuture(const QSharedPointer<WorkState<T>> &d)
+        : d(d)
+    {
+    }
+public:
+    inline bool isValid() const { return !d.isNull(); }
+    inline bool isFinished() const { return d.isNull() || d->done.isSet(); }
+    inline bool isCancelled() const { return !d.isNull() && d->skipped.loadAcquire(); }
+    inline void cancel() { if (d) d->token.cancel(); }
+    inline CancellationToken token() const { return d ? d->token : CancellationToken(); }
+    // a pool thread runs other queued tasks while it waits, so tasks may wait for the tasks they submit.
+    bool wait(const QDeadlineTimer &deadline = QDeadlineTimer(QDeadlineTimer::Forever)) const;
+    T result() const;  // waits. a skipped task leaves a default constructed T.
+private:
+    QSharedPointer<WorkState<T>> d;
+};
+
+// one thread per core, each with its own deques. a thread takes the newest task of its own deque and steals the oldest
+// of others when it runs dry. every Interactive task is taken before any Prefetch task.
+class WorkStealingPoolPrivate;
+class WorkStealingPool
+{
+public:
+    enum Priority {
+        Interactive = 0,  // somebody is looking at the result.
+        Prefetch = 1,  // speculative work, runs only when no interactive task is queued.
+    };
+public:
+    explicit WorkStealingPool(int threadCount = 0);  // 0 means QThread::idealThreadCount().
+    ~WorkStealingPool();  // runs the queued tasks, then joins the threads.
+    static WorkStealingPool *globalInstance();
+public:
+    int threadCount() const;
+    template<typename F>
+    auto submit(F f, Priority priority = Interactive, const CancellationToken &token = CancellationToken())
+            -> WorkFuture<decltype(f())>;
+    // call f(i) for every i in [0, count) and return when all are done. the calling thread takes part.
+    template<typename F>
+    void parallelFor(int count, F f, Priority priority = Interactive);
+private:
+    template<typename T> friend class WorkFuture;
+    void enqueue(std::function<void()> &&task, Priority priority);
+    bool runPendingTask();  // runs one queued task if the calling thread belongs to this pool.
+    bool helpUntil(Event &done, const QDeadlineTimer &deadline);
+    void wakeHelpers();  // after setting an event that helpUntil() may wait for.
+private:
+    WorkStealingPoolPrivate * const d;
+    Q_DISABLE_COPY(WorkStealingPool)
+};
+
+template<typename T>
+bool WorkFuture<T>::wait(const QDeadlineTimer &deadline) const
+{
+    if (d.isNull()) {
+        return true;
+    }
+    return d->pool->helpUntil(d->done, deadline);
+}
+
+template<typename T>
+T WorkFuture<T>::result() const
+{
+    Q_ASSERT(!d.isNull());
+    wait();
+    return d->value;
+}
+
+template<typename F>
+auto WorkStealingPool::submit(F f, Priority priority, const CancellationToken &token) -> WorkFuture<decltype(f())>
+{
+    typedef decltype(f()) R;
+    QSharedPointer<WorkState<R>> state(new WorkState<R>(this, token));
+    enqueue([state, f]() mutable {
+        if (state->token.isCancelled()) {
+            state->skipped.storeRelease(true);
+        } else {
+            state->run(f);
+        }
+        state->done.set();
+        state->pool->wakeHelpers();
+    }, priority);
+    return WorkFuture<R>(state);
+}
+
+template<typename F>
+void WorkStealingPool::parallelFor(int count, F f, Priority priority)
+{
+    if (count <= 0) {
+        return;
+    }
+    struct Loop
+    {
+        QAtomicInt next;
+        QAtomicInt remaining;
+        Event done;
+    };
+    QSharedPointer<Loop> loop(new Loop());
+    loop->next.storeRelease(0);
+    loop->remaining.storeRelease(count);
+    // a helper that starts after the last index is claimed returns without touching f, so f may live on our stack.
+    auto claim = [this, loop, &f, count] {
+        int i;
+        while ((i = loop->next.fetchAndAddOrdered(1)) < count) {
+            f(i);
+            if (loop->remaining.fetchAndSubOrdered(1) == 1) {
+                loop->done.set();
+                wakeHelpers();
+            }
+        }
+    };
+    CancellationToken helpers;
+    for (int i = qMin(count - 1, threadCount()); i > 0; --i) {
+        submit(claim, priority, helpers);
+    }
+    claim();
+    helpUntil(loop->done, QDeadlineTimer(QDeadlineTimer::Forever));
+    helpers.cancel();
+}
+
+#endif